@@ -3,34 +3,414 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <math.h>
 #include "lauxlib.h"
 #include <Windows.h>
 
+// SSE is always there on the x86 targets pvx is built for, the scalar code paths are kept
+// for other architectures.
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1) || defined(__SSE__)
+#define PVX_SSE 1
+#include <xmmintrin.h>
+#endif
+
 #define MAX_SHAPES 512
+#define MAX_LODS 8
+#define MAX_ATLAS_PAGES 16
+#define MAX_GLYPHS 1024
+#define MAX_GLYPH_SHELVES 256
+#define MAX_FONTS 8
+#define MAX_LAYER_CACHES 16
+#define NO_LAYER_CACHE 0xffffffff
+#define NO_COMMAND_LIST 0xffffffff
+#define PACING_HISTORY 128
+#define FRAME_STATS_HISTORY 256
+#define GPU_TIMER_FRAMES 4
+#define MAX_GPU_TIMESTAMPS 64
 
 typedef unsigned Handle;
 
+typedef enum FillMode {
+    FILL_MODE_TRIANGULATE,
+    FILL_MODE_STENCIL
+} FillMode;
+
+// Stencil filled shapes store their bounding rectangle after the outline vertices and the
+// indices used to cover it after the fan indices.
+static const unsigned cover_vertex_count = 4;
+static const unsigned cover_index_count = 6;
+
+// One level of detail of a shape, simplified so that no vertex moves more than tolerance.
+// Level 0 is the shape as it was made, with a tolerance of 0.
+typedef struct ShapeLod {
+    unsigned first_vertex;
+    unsigned first_index;
+    unsigned index_count;
+    float tolerance;
+} ShapeLod;
+
+// All shapes live in one vertex arena and one index arena. Indices are relative to the
+// shape's first vertex, which is passed as base vertex when drawing. Dynamic shapes keep
+// room for vertex_capacity vertices so that their geometry can be rewritten in place.
+// Static shapes also keep coarser levels of detail, with increasing tolerance.
 typedef struct Shape {
-    GLuint geometry_handle;
-    unsigned count;
+    unsigned first_vertex;
+    unsigned vertex_capacity;
+    unsigned first_index;
+    unsigned index_capacity;
+    ShapeLod lods[MAX_LODS];
+    unsigned num_lods;
+    FillMode fill_mode;
+    int dynamic;
+    float color[3];
+    float bounds[4];
+    unsigned last_draw_flush;
 } Shape;
 
-typedef struct LoadedFile
-{
-    int loaded;
-    char* data;
-    size_t size;
-} LoadedFile;
+typedef struct Arena {
+    GLuint buffer;
+    unsigned used;
+    unsigned capacity;
+    unsigned element_size;
+} Arena;
+
+// Per instance vertex data, fed to the shape shader with an attribute divisor of 1. The
+// shader scales, rotates (radians) and then translates the shape's vertices by it, and
+// multiplies their color by tint. depth is only used with depth layering. params holds
+// data specific to the program, primitives keep their half extents and corner radius there
+// and sprites and glyphs their rectangle in the atlas.
+// Line segments start at x, y and use rotation and scale as their direction and length.
+typedef struct Instance {
+    float x, y;
+    float rotation;
+    float scale;
+    unsigned char tint[4];
+    float depth;
+    float params[4];
+} Instance;
+
+// Draws are submitted in order of their sort key, which from the most significant bit is:
+// 16 bits layer, 1 bit ordered, then either 4 bits program, 1 bit stencil fill, 16 bits
+// shape and 3 bits level of detail, or the draw's sequence number if it is ordered. Draws are ordered if they are
+// blended or made without a layer set, those keep the order they were made in. All other
+// draws may be reordered within their layer, which groups them by state.
+// With depth layering the depth test keeps layers apart instead, so opaque layered draws
+// are moved in front of everything else as 1 bit zero, 4 bits program, 1 bit stencil fill,
+// 16 bits shape, 3 bits level of detail and 16 bits inverted layer. The other draws follow as 1 bit one, 16 bits
+// layer and their sequence number.
+typedef enum Program {
+    PROGRAM_SHAPE,
+    PROGRAM_PRIMITIVE,
+    PROGRAM_LINE,
+    PROGRAM_SPRITE,
+    PROGRAM_TEXT,
+    NUM_PROGRAMS
+} Program;
+
+#define NO_LAYER 0x7fffffff
+
+// How a line segment ends. Flat ends are cut along a line through the end point, straight
+// across for butt caps or along the bisector of a miter join, and bevels cut that further.
+// Round joins are cut along the bisector as well, so neighbouring segments never overlap.
+typedef enum LineEnd {
+    LINE_END_FLAT,
+    LINE_END_SQUARE,
+    LINE_END_ROUND,
+    LINE_END_ROUND_JOIN,
+    LINE_END_BEVEL
+} LineEnd;
+
+// How flip waits for the display. Adaptive waits for vertical sync unless the frame is
+// already late, and immediate never waits.
+typedef enum PresentMode {
+    PRESENT_MODE_VSYNC,
+    PRESENT_MODE_ADAPTIVE,
+    PRESENT_MODE_IMMEDIATE
+} PresentMode;
+
+// Where the time of a frame went. Idle is time spent blocked waiting for messages, which
+// is kept apart from handling them. Recording is what is left of the frame after the
+// others, which is mostly the Lua code making draws.
+typedef enum FrameTiming {
+    FRAME_TIMING_EVENTS,
+    FRAME_TIMING_RECORDING,
+    FRAME_TIMING_SUBMISSION,
+    FRAME_TIMING_PRESENT,
+    FRAME_TIMING_IDLE,
+    FRAME_TIMING_FRAME,
+    NUM_FRAME_TIMINGS
+} FrameTiming;
+
+// The kinds of GPU work that are timed. Draws made into layer caches count as draws, the
+// layer cache pass is clearing and compositing them.
+typedef enum GpuPass {
+    GPU_PASS_CLEAR,
+    GPU_PASS_DRAWS,
+    GPU_PASS_LAYER_CACHES,
+    NUM_GPU_PASSES
+} GpuPass;
+
+// Timestamp queries made during a frame, a pair around every timed pass. They are read
+// GPU_TIMER_FRAMES frames later, by when the GPU has normally long finished them.
+typedef struct GpuTimerFrame {
+    GLuint queries[MAX_GPU_TIMESTAMPS];
+    GpuPass passes[MAX_GPU_TIMESTAMPS / 2];
+    unsigned num_timestamps;
+} GpuTimerFrame;
+
+typedef struct Stroke {
+    float half_width;
+    LineEnd cap;
+    LineEnd join;
+} Stroke;
+
+typedef struct Draw {
+    uint64_t sort_key;
+    Program program;
+    Handle shape;
+    unsigned lod;
+    int blended;
+    Instance instance;
+} Draw;
+
+// Images are packed into the pages of one texture array, each page is filled bottom up
+// along a skyline of segments, x and width in pixels, at the height y that is used so far.
+typedef struct SkylineSegment {
+    unsigned x;
+    unsigned y;
+    unsigned width;
+} SkylineSegment;
+
+typedef struct AtlasPage {
+    SkylineSegment* skyline;
+    unsigned num_segments;
+    unsigned capacity;
+} AtlasPage;
+
+typedef struct Atlas {
+    GLuint texture;
+    unsigned size;
+    AtlasPage pages[MAX_ATLAS_PAGES];
+    unsigned num_pages;
+} Atlas;
+
+// An image's rectangle within its atlas page, in pixels. translucent tells if any of its
+// pixels have an alpha below 255, sprites of it are then blended.
+typedef struct Image {
+    unsigned page;
+    unsigned x, y;
+    unsigned width, height;
+    int translucent;
+} Image;
+
+// A glyph of the font at size pixels, rasterized into the glyph atlas at x, y on one of its
+// shelves. left and top place its bitmap relative to the pen position on the baseline.
+typedef struct Glyph {
+    unsigned codepoint;
+    unsigned size;
+    unsigned shelf;
+    unsigned x, y;
+    unsigned width, height;
+    int left, top;
+    float advance;
+} Glyph;
+
+// Glyphs are packed left to right onto shelves, rows of the atlas as high as the first
+// glyph put on them. Shelves are the unit of eviction, the one used the longest ago is
+// emptied when a glyph does not fit anywhere else.
+typedef struct GlyphShelf {
+    unsigned y;
+    unsigned height;
+    unsigned used;
+    unsigned last_used;
+} GlyphShelf;
+
+typedef struct Font {
+    unsigned size;
+    HFONT handle;
+    float ascent;
+    float line_height;
+    unsigned last_used;
+} Font;
+
+// A group of draws rendered into a texture a guard band of pixels larger than the window on
+// every side, and composited each frame instead of being drawn again. It is rendered again
+// when invalidated, or when the view zooms, rotates or moves by more than the guard band
+// since, which the translation of the view matrix it was rendered with tells.
+typedef struct LayerCache {
+    GLuint framebuffer;
+    GLuint texture;
+    GLuint depth_stencil;
+    unsigned guard;
+    unsigned width, height;
+    int valid;
+    float zoom;
+    float rotation;
+    float translation[2];
+} LayerCache;
+
+// Glyphs are found through an open addressed table of indices into glyphs, -1 where empty,
+// which is rebuilt whenever glyphs are evicted.
+typedef struct GlyphCache {
+    GLuint texture;
+    HDC device_context;
+    Font fonts[MAX_FONTS];
+    unsigned num_fonts;
+    Glyph glyphs[MAX_GLYPHS];
+    unsigned num_glyphs;
+    int table[MAX_GLYPHS * 2];
+    GlyphShelf shelves[MAX_GLYPH_SHELVES];
+    unsigned num_shelves;
+    unsigned next_shelf_y;
+} GlyphCache;
+
+typedef struct SortItem {
+    uint64_t key;
+    unsigned index;
+} SortItem;
+
+// Per frame data is streamed through a ring of STREAM_FRAMES regions. A region is only
+// written again once the fence placed after its last use has signaled, so writing never
+// has to wait for the driver. With buffer storage support the ring stays persistently
+// mapped, otherwise writes go to staging memory that is copied in with an unsynchronized
+// mapping before drawing.
+#define STREAM_FRAMES 3
+
+typedef struct StreamRing {
+    GLuint buffer;
+    char* mapped;
+    char* staging;
+    unsigned region_size;
+    unsigned region;
+    unsigned offset;
+    unsigned committed;
+    GLsync fences[STREAM_FRAMES];
+} StreamRing;
+
+// Mirrors the GL state that pvx changes most often, so that binding what is already bound
+// costs nothing. Everything that changes this state has to go through the functions that
+// keep the cache up to date.
+static const GLenum cached_buffer_targets[] = { GL_ARRAY_BUFFER, GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, GL_DRAW_INDIRECT_BUFFER, GL_UNIFORM_BUFFER };
+static const GLenum cached_capabilities[] = { GL_STENCIL_TEST, GL_BLEND, GL_DEPTH_TEST };
+#define NUM_CACHED_BUFFER_TARGETS (sizeof(cached_buffer_targets) / sizeof(cached_buffer_targets[0]))
+#define NUM_CACHED_CAPABILITIES (sizeof(cached_capabilities) / sizeof(cached_capabilities[0]))
+
+typedef struct StateCache {
+    GLuint program;
+    GLuint vertex_array;
+    GLuint buffers[NUM_CACHED_BUFFER_TARGETS];
+    int capabilities[NUM_CACHED_CAPABILITIES];
+    GLuint instance_buffer;
+    size_t instance_offset;
+} StateCache;
+
+// Layout mandated by glMultiDrawElementsIndirect.
+typedef struct DrawElementsIndirectCommand {
+    GLuint count;
+    GLuint instance_count;
+    GLuint first_index;
+    GLint base_vertex;
+    GLuint base_instance;
+} DrawElementsIndirectCommand;
+
+// A sorted and merged sequence of draws, kept in a buffer of its own that holds the
+// instances followed by the commands. bounds is the world box around all of them.
+typedef struct CommandList {
+    GLuint buffer;
+    size_t command_offset;
+    Draw* draws;
+    unsigned num_draws;
+    DrawElementsIndirectCommand* commands;
+    unsigned num_commands;
+    float bounds[4];
+} CommandList;
 
 static HWND g_window_handle;
 static HDC g_device_context;
 static HGLRC g_rendering_context;
-static GLuint g_shader;
+static GLuint g_programs[NUM_PROGRAMS];
+static GLuint g_shape_vertex_array;
+static StateCache g_state;
 static Shape g_shapes[MAX_SHAPES];
+static Handle g_quad_shape;
+static const float miter_limit = 4;
+static const float lod_pixel_tolerance = 0.5f;
+static const unsigned glyph_atlas_size = 1024;
+static const char* font_face = "Arial";
+static float* g_line_points;
+static Atlas g_atlas;
+static Image* g_images;
+static GlyphCache g_glyph_cache;
+static LayerCache g_layer_caches[MAX_LAYER_CACHES];
+static unsigned g_num_layer_caches;
+static unsigned g_open_layer_cache;
+static unsigned g_recording_layer_cache;
+static GLuint g_layer_cache_program;
+static GLint g_layer_cache_rect_location;
+static unsigned g_num_images;
+static unsigned g_images_capacity;
+static unsigned g_line_points_capacity;
 static unsigned g_free_shapes[MAX_SHAPES];
+static Arena g_vertex_arena;
+static Arena g_index_arena;
+static StreamRing g_stream;
+static GLuint g_instance_buffer;
+static size_t g_instance_offset;
+static size_t g_command_offset;
+static CommandList* g_command_lists;
+static unsigned g_num_command_lists;
+static unsigned g_command_lists_capacity;
+static int g_recording_commands;
+static Draw* g_draws;
+static unsigned g_num_draws;
+static unsigned g_draws_capacity;
+static unsigned g_flush_count;
+static DrawElementsIndirectCommand* g_commands;
+static unsigned g_commands_capacity;
 static float g_projection_matrix[16];
 static float g_view_matrix[16];
-static GLuint g_model_view_projection_matrix_location;
+static float g_view_position[2];
+static float g_view_zoom;
+static float g_view_rotation;
+static unsigned char g_tint[4];
+static int g_layer;
+static int g_depth_layering;
+static SortItem* g_sort_items;
+static SortItem* g_sort_scratch;
+static unsigned g_sort_capacity;
+static Draw* g_sorted_draws;
+static unsigned g_sorted_draws_capacity;
+static float g_view_projection_matrix[16];
+static float* g_draw_bounds;
+static unsigned g_draw_bounds_capacity;
+static int g_camera_dirty;
+static float g_clear_color[3];
+static int g_clear_pending;
+static int g_clear_depth;
+static int g_frame_submitted;
+static int g_frame_dirty;
+static int g_skip_unchanged_frames;
+static int g_presented_frame_known;
+static uint64_t g_presented_frame_hash;
+static unsigned g_refresh_interval;
+static const DWORD hidden_event_wait = 100;
+static LARGE_INTEGER g_clock_frequency;
+static const double limiter_spin_time = 0.002;
+static const double max_run_lag = 0.25;
+static double g_target_frame_time;
+static double g_frame_deadline;
+static float g_pacing_errors[PACING_HISTORY];
+static unsigned g_num_pacing_errors;
+static double g_frame_timing[NUM_FRAME_TIMINGS];
+static double g_frame_start;
+static float g_frame_stats[FRAME_STATS_HISTORY][NUM_FRAME_TIMINGS];
+static unsigned g_num_frame_stats;
+static GpuTimerFrame g_gpu_timers[GPU_TIMER_FRAMES];
+static unsigned g_gpu_timer_frame;
+static double g_gpu_times[NUM_GPU_PASSES + 1];
+static int g_gpu_times_known;
 static const unsigned floats_per_vertex = 5;
 static lua_State* g_lua_state;
 static int g_held_keys[256];
@@ -44,34 +424,493 @@ static int g_window_closed;
 
 static void mat_ident(float* out)
 {
-    memset(out, 0, 16 * sizeof(float));
-    out[0] = 1;
-    out[5] = 1;
-    out[10] = 1;
-    out[15] = 1;
+    static const float identity[16] = { 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1 };
+    memcpy(out, identity, sizeof(identity));
+}
+
+static void mat_mul(const float* m1, const float* m2, float* out)
+{
+#if PVX_SSE
+    __m128 row0 = _mm_loadu_ps(m2);
+    __m128 row1 = _mm_loadu_ps(m2 + 4);
+    __m128 row2 = _mm_loadu_ps(m2 + 8);
+    __m128 row3 = _mm_loadu_ps(m2 + 12);
+
+    for (unsigned i = 0; i < 16; i += 4)
+    {
+        __m128 result = _mm_mul_ps(_mm_set1_ps(m1[i]), row0);
+        result = _mm_add_ps(result, _mm_mul_ps(_mm_set1_ps(m1[i + 1]), row1));
+        result = _mm_add_ps(result, _mm_mul_ps(_mm_set1_ps(m1[i + 2]), row2));
+        result = _mm_add_ps(result, _mm_mul_ps(_mm_set1_ps(m1[i + 3]), row3));
+        _mm_storeu_ps(out + i, result);
+    }
+#else
+    float result[16];
+
+    for (unsigned i = 0; i < 16; i += 4)
+    {
+        for (unsigned j = 0; j < 4; ++j)
+            result[i + j] = m1[i] * m2[j] + m1[i + 1] * m2[4 + j] + m1[i + 2] * m2[8 + j] + m1[i + 3] * m2[12 + j];
+    }
+
+    memcpy(out, result, sizeof(result));
+#endif
+}
+
+// Transforms count 2D points, stored as x, y pairs, by the 2D part of matrix. in and out
+// may be the same array.
+static void transform_points(const float* matrix, const float* in, float* out, unsigned count)
+{
+    unsigned i = 0;
+
+#if PVX_SSE
+    __m128 column_x = _mm_setr_ps(matrix[0], matrix[1], matrix[0], matrix[1]);
+    __m128 column_y = _mm_setr_ps(matrix[4], matrix[5], matrix[4], matrix[5]);
+    __m128 translation = _mm_setr_ps(matrix[12], matrix[13], matrix[12], matrix[13]);
+
+    for (; i + 2 <= count; i += 2)
+    {
+        __m128 points = _mm_loadu_ps(in + i * 2);
+        __m128 xs = _mm_shuffle_ps(points, points, _MM_SHUFFLE(2, 2, 0, 0));
+        __m128 ys = _mm_shuffle_ps(points, points, _MM_SHUFFLE(3, 3, 1, 1));
+        __m128 result = _mm_add_ps(_mm_mul_ps(xs, column_x), _mm_mul_ps(ys, column_y));
+        _mm_storeu_ps(out + i * 2, _mm_add_ps(result, translation));
+    }
+#endif
+
+    for (; i < count; ++i)
+    {
+        float x = in[i * 2];
+        float y = in[i * 2 + 1];
+        out[i * 2] = matrix[0] * x + matrix[4] * y + matrix[12];
+        out[i * 2 + 1] = matrix[1] * x + matrix[5] * y + matrix[13];
+    }
+}
+
+// Transforms count axis aligned boxes, stored as min x, min y, max x, max y, by the 2D part
+// of matrix and writes the boxes that bound the results. in and out may be the same array.
+static void transform_aabbs(const float* matrix, const float* in, float* out, unsigned count)
+{
+#if PVX_SSE
+    __m128 column_x = _mm_setr_ps(matrix[0], matrix[1], matrix[0], matrix[1]);
+    __m128 column_y = _mm_setr_ps(matrix[4], matrix[5], matrix[4], matrix[5]);
+    __m128 translation = _mm_setr_ps(matrix[12], matrix[13], matrix[12], matrix[13]);
+    __m128 sign_mask = _mm_set1_ps(-0.0f);
+    __m128 abs_column_x = _mm_andnot_ps(sign_mask, column_x);
+    __m128 abs_column_y = _mm_andnot_ps(sign_mask, column_y);
+    __m128 half = _mm_set1_ps(0.5f);
+    __m128 extent_sign = _mm_setr_ps(-1, -1, 1, 1);
+
+    for (unsigned i = 0; i < count; ++i)
+    {
+        // Transform the center and project the half extents onto the new axes.
+        __m128 box = _mm_loadu_ps(in + i * 4);
+        __m128 swapped = _mm_shuffle_ps(box, box, _MM_SHUFFLE(1, 0, 3, 2));
+        __m128 center = _mm_mul_ps(_mm_add_ps(box, swapped), half);
+        __m128 extent = _mm_andnot_ps(sign_mask, _mm_mul_ps(_mm_sub_ps(swapped, box), half));
+        __m128 cx = _mm_shuffle_ps(center, center, _MM_SHUFFLE(0, 0, 0, 0));
+        __m128 cy = _mm_shuffle_ps(center, center, _MM_SHUFFLE(1, 1, 1, 1));
+        __m128 ex = _mm_shuffle_ps(extent, extent, _MM_SHUFFLE(0, 0, 0, 0));
+        __m128 ey = _mm_shuffle_ps(extent, extent, _MM_SHUFFLE(1, 1, 1, 1));
+        center = _mm_add_ps(_mm_add_ps(_mm_mul_ps(cx, column_x), _mm_mul_ps(cy, column_y)), translation);
+        extent = _mm_add_ps(_mm_mul_ps(ex, abs_column_x), _mm_mul_ps(ey, abs_column_y));
+        _mm_storeu_ps(out + i * 4, _mm_add_ps(center, _mm_mul_ps(extent, extent_sign)));
+    }
+#else
+    for (unsigned i = 0; i < count; ++i)
+    {
+        const float* box = in + i * 4;
+        float cx = (box[0] + box[2]) * 0.5f;
+        float cy = (box[1] + box[3]) * 0.5f;
+        float ex = (box[2] - box[0]) * 0.5f;
+        float ey = (box[3] - box[1]) * 0.5f;
+        float new_cx = matrix[0] * cx + matrix[4] * cy + matrix[12];
+        float new_cy = matrix[1] * cx + matrix[5] * cy + matrix[13];
+        float new_ex = (matrix[0] < 0 ? -matrix[0] : matrix[0]) * ex + (matrix[4] < 0 ? -matrix[4] : matrix[4]) * ey;
+        float new_ey = (matrix[1] < 0 ? -matrix[1] : matrix[1]) * ex + (matrix[5] < 0 ? -matrix[5] : matrix[5]) * ey;
+        out[i * 4] = new_cx - new_ex;
+        out[i * 4 + 1] = new_cy - new_ey;
+        out[i * 4 + 2] = new_cx + new_ex;
+        out[i * 4 + 3] = new_cy + new_ey;
+    }
+#endif
+}
+
+static const char* shape_vertex_shader_source =
+    "#version 330\n"
+    "layout(location = 0) in vec2 position;\n"
+    "layout(location = 1) in vec3 color;\n"
+    "layout(location = 2) in vec4 instance;\n"
+    "layout(location = 3) in vec4 tint;\n"
+    "layout(location = 4) in float depth;\n"
+    "layout(std140) uniform Camera\n"
+    "{\n"
+    "    mat4 view_projection_matrix;\n"
+    "};\n"
+    "out vec4 vertex_color;\n"
+    "void main()\n"
+    "{\n"
+    "    vertex_color = vec4(color, 1) * tint;\n"
+    "    vec2 scaled = position * instance.w;\n"
+    "    float c = cos(instance.z);\n"
+    "    float s = sin(instance.z);\n"
+    "    vec2 world = vec2(c * scaled.x - s * scaled.y, s * scaled.x + c * scaled.y) + instance.xy;\n"
+    "    gl_Position = view_projection_matrix * vec4(world, 0, 1);\n"
+    "    gl_Position.z = depth;\n"
+    "}\n";
+
+static const char* shape_fragment_shader_source =
+    "#version 330\n"
+    "in vec4 vertex_color;\n"
+    "out vec4 fragment_color;\n"
+    "void main()\n"
+    "{\n"
+    "    fragment_color = vertex_color;\n"
+    "}\n";
+
+// Primitives are the unit quad stretched to their half extents. The fragment shader finds
+// the signed distance to the rounded rectangle within it, circles and capsules being
+// rounded rectangles with a corner radius as large as they allow. Edges are smoothed over
+// about a pixel, at any zoom, so the quad is grown by a pixel on every side to leave room
+// for the half of the ramp that lies outside the edge.
+static const char* primitive_vertex_shader_source =
+    "#version 330\n"
+    "layout(location = 0) in vec2 position;\n"
+    "layout(location = 2) in vec4 instance;\n"
+    "layout(location = 3) in vec4 tint;\n"
+    "layout(location = 4) in float depth;\n"
+    "layout(location = 5) in vec4 params;\n"
+    "layout(std140) uniform Camera\n"
+    "{\n"
+    "    mat4 view_projection_matrix;\n"
+    "    float pixel_size;\n"
+    "};\n"
+    "out vec4 vertex_color;\n"
+    "out vec2 local_position;\n"
+    "flat out vec3 rounded_rect;\n"
+    "void main()\n"
+    "{\n"
+    "    vertex_color = tint;\n"
+    "    rounded_rect = params.xyz;\n"
+    "    float padding = pixel_size / max(abs(instance.w), 1e-6);\n"
+    "    local_position = position * (params.xy + padding);\n"
+    "    vec2 scaled = local_position * instance.w;\n"
+    "    float c = cos(instance.z);\n"
+    "    float s = sin(instance.z);\n"
+    "    vec2 world = vec2(c * scaled.x - s * scaled.y, s * scaled.x + c * scaled.y) + instance.xy;\n"
+    "    gl_Position = view_projection_matrix * vec4(world, 0, 1);\n"
+    "    gl_Position.z = depth;\n"
+    "}\n";
+
+static const char* primitive_fragment_shader_source =
+    "#version 330\n"
+    "in vec4 vertex_color;\n"
+    "in vec2 local_position;\n"
+    "flat in vec3 rounded_rect;\n"
+    "out vec4 fragment_color;\n"
+    "void main()\n"
+    "{\n"
+    "    vec2 q = abs(local_position) - rounded_rect.xy + rounded_rect.z;\n"
+    "    float distance = length(max(q, 0.0)) + min(max(q.x, q.y), 0.0) - rounded_rect.z;\n"
+    "    float coverage = clamp(0.5 - distance / max(fwidth(distance), 1e-5), 0.0, 1.0);\n"
+    "    if (coverage == 0.0)\n"
+    "        discard;\n"
+    "    fragment_color = vec4(vertex_color.rgb, vertex_color.a * coverage);\n"
+    "}\n";
+
+// Line segments stretch the unit quad from their start to their end, and past them by as
+// much as their ends need plus a pixel for smoothing, like primitives. params holds the half width, the slopes of the lines the start
+// and end are cut along, and the kinds of both ends (LineEnd) as start + 8 * end. The
+// fragment shader works in the segment's frame, where it runs along x from 0 to its length.
+static const char* line_vertex_shader_source =
+    "#version 330\n"
+    "layout(location = 0) in vec2 position;\n"
+    "layout(location = 2) in vec4 instance;\n"
+    "layout(location = 3) in vec4 tint;\n"
+    "layout(location = 4) in float depth;\n"
+    "layout(location = 5) in vec4 params;\n"
+    "layout(std140) uniform Camera\n"
+    "{\n"
+    "    mat4 view_projection_matrix;\n"
+    "    float pixel_size;\n"
+    "};\n"
+    "out vec4 vertex_color;\n"
+    "out vec2 local_position;\n"
+    "flat out vec4 segment;\n"
+    "flat out ivec2 ends;\n"
+    "float extension(int kind, float slope)\n"
+    "{\n"
+    "    return kind == 0 ? params.x * abs(slope) : params.x;\n"
+    "}\n"
+    "void main()\n"
+    "{\n"
+    "    vertex_color = tint;\n"
+    "    ends = ivec2(int(params.w) % 8, int(params.w) / 8);\n"
+    "    segment = vec4(instance.w, params.xyz);\n"
+    "    float start = -extension(ends.x, params.y) - pixel_size;\n"
+    "    float end = instance.w + extension(ends.y, params.z) + pixel_size;\n"
+    "    local_position = vec2(mix(start, end, position.x * 0.5 + 0.5), position.y * (params.x + pixel_size));\n"
+    "    float c = cos(instance.z);\n"
+    "    float s = sin(instance.z);\n"
+    "    vec2 world = vec2(c * local_position.x - s * local_position.y, s * local_position.x + c * local_position.y) + instance.xy;\n"
+    "    gl_Position = view_projection_matrix * vec4(world, 0, 1);\n"
+    "    gl_Position.z = depth;\n"
+    "}\n";
+
+// Sprites are the unit quad stretched to the size of their image. params holds the image's
+// rectangle in pixels, with the atlas pages stacked on top of each other along y.
+static const char* sprite_vertex_shader_source =
+    "#version 330\n"
+    "layout(location = 0) in vec2 position;\n"
+    "layout(location = 2) in vec4 instance;\n"
+    "layout(location = 3) in vec4 tint;\n"
+    "layout(location = 4) in float depth;\n"
+    "layout(location = 5) in vec4 params;\n"
+    "layout(std140) uniform Camera\n"
+    "{\n"
+    "    mat4 view_projection_matrix;\n"
+    "};\n"
+    "uniform sampler2DArray atlas;\n"
+    "out vec4 vertex_color;\n"
+    "out vec3 texture_coordinates;\n"
+    "void main()\n"
+    "{\n"
+    "    vertex_color = tint;\n"
+    "    vec2 size = vec2(textureSize(atlas, 0).xy);\n"
+    "    float page = floor(params.y / size.y);\n"
+    "    vec2 corner = params.xy - vec2(0, page * size.y) + (position * 0.5 + 0.5) * params.zw;\n"
+    "    texture_coordinates = vec3(corner / size, page);\n"
+    "    vec2 scaled = position * 0.5 * params.zw * instance.w;\n"
+    "    float c = cos(instance.z);\n"
+    "    float s = sin(instance.z);\n"
+    "    vec2 world = vec2(c * scaled.x - s * scaled.y, s * scaled.x + c * scaled.y) + instance.xy;\n"
+    "    gl_Position = view_projection_matrix * vec4(world, 0, 1);\n"
+    "    gl_Position.z = depth;\n"
+    "}\n";
+
+static const char* sprite_fragment_shader_source =
+    "#version 330\n"
+    "uniform sampler2DArray atlas;\n"
+    "in vec4 vertex_color;\n"
+    "in vec3 texture_coordinates;\n"
+    "out vec4 fragment_color;\n"
+    "void main()\n"
+    "{\n"
+    "    vec4 color = texture(atlas, texture_coordinates) * vertex_color;\n"
+    "    if (color.a == 0.0)\n"
+    "        discard;\n"
+    "    fragment_color = color;\n"
+    "}\n";
+
+// Glyphs are drawn like sprites, from a single channel atlas holding their coverage.
+static const char* text_vertex_shader_source =
+    "#version 330\n"
+    "layout(location = 0) in vec2 position;\n"
+    "layout(location = 2) in vec4 instance;\n"
+    "layout(location = 3) in vec4 tint;\n"
+    "layout(location = 4) in float depth;\n"
+    "layout(location = 5) in vec4 params;\n"
+    "layout(std140) uniform Camera\n"
+    "{\n"
+    "    mat4 view_projection_matrix;\n"
+    "};\n"
+    "uniform sampler2D glyphs;\n"
+    "out vec4 vertex_color;\n"
+    "out vec2 texture_coordinates;\n"
+    "void main()\n"
+    "{\n"
+    "    vertex_color = tint;\n"
+    "    texture_coordinates = (params.xy + (position * 0.5 + 0.5) * params.zw) / vec2(textureSize(glyphs, 0));\n"
+    "    vec2 scaled = position * 0.5 * params.zw * instance.w;\n"
+    "    float c = cos(instance.z);\n"
+    "    float s = sin(instance.z);\n"
+    "    vec2 world = vec2(c * scaled.x - s * scaled.y, s * scaled.x + c * scaled.y) + instance.xy;\n"
+    "    gl_Position = view_projection_matrix * vec4(world, 0, 1);\n"
+    "    gl_Position.z = depth;\n"
+    "}\n";
+
+static const char* text_fragment_shader_source =
+    "#version 330\n"
+    "uniform sampler2D glyphs;\n"
+    "in vec4 vertex_color;\n"
+    "in vec2 texture_coordinates;\n"
+    "out vec4 fragment_color;\n"
+    "void main()\n"
+    "{\n"
+    "    float coverage = texture(glyphs, texture_coordinates).r;\n"
+    "    if (coverage == 0.0)\n"
+    "        discard;\n"
+    "    fragment_color = vec4(vertex_color.rgb, vertex_color.a * coverage);\n"
+    "}\n";
+
+// Composites a layer cache's texture, its premultiplied colors, onto the rectangle given in
+// clip space from the top left to the bottom right corner.
+static const char* layer_cache_vertex_shader_source =
+    "#version 330\n"
+    "layout(location = 0) in vec2 position;\n"
+    "uniform vec4 rect;\n"
+    "out vec2 texture_coordinates;\n"
+    "void main()\n"
+    "{\n"
+    "    vec2 corner = position * 0.5 + 0.5;\n"
+    "    texture_coordinates = vec2(corner.x, 1.0 - corner.y);\n"
+    "    gl_Position = vec4(mix(rect.xy, rect.zw, corner), 0, 1);\n"
+    "}\n";
+
+static const char* layer_cache_fragment_shader_source =
+    "#version 330\n"
+    "uniform sampler2D layer;\n"
+    "in vec2 texture_coordinates;\n"
+    "out vec4 fragment_color;\n"
+    "void main()\n"
+    "{\n"
+    "    fragment_color = texture(layer, texture_coordinates);\n"
+    "}\n";
+
+static const char* line_fragment_shader_source =
+    "#version 330\n"
+    "in vec4 vertex_color;\n"
+    "in vec2 local_position;\n"
+    "flat in vec4 segment;\n"
+    "flat in ivec2 ends;\n"
+    "out vec4 fragment_color;\n"
+    "float end_distance(vec2 p, float half_width, float slope, int kind)\n"
+    "{\n"
+    "    float norm = sqrt(1.0 + slope * slope);\n"
+    "    float cut = -(p.x + slope * p.y) / norm;\n"
+    "    float strip = abs(p.y) - half_width;\n"
+    "    float round = p.x < 0.0 ? length(p) - half_width : strip;\n"
+    "    if (kind == 1)\n"
+    "        return max(strip, -p.x - half_width);\n"
+    "    if (kind == 2)\n"
+    "        return round;\n"
+    "    if (kind == 3)\n"
+    "        return max(cut, round);\n"
+    "    if (kind == 4)\n"
+    "        return max(max(cut, strip), (sign(slope) * (p.y - slope * p.x) - half_width) / norm);\n"
+    "    return max(cut, strip);\n"
+    "}\n"
+    "void main()\n"
+    "{\n"
+    "    vec2 p = local_position;\n"
+    "    float distance = max(end_distance(p, segment.y, segment.z, ends.x), end_distance(vec2(segment.x - p.x, p.y), segment.y, segment.w, ends.y));\n"
+    "    float coverage = clamp(0.5 - distance / max(fwidth(distance), 1e-5), 0.0, 1.0);\n"
+    "    if (coverage == 0.0)\n"
+    "        discard;\n"
+    "    fragment_color = vec4(vertex_color.rgb, vertex_color.a * coverage);\n"
+    "}\n";
+
+static void* grow_array(void* data, unsigned* capacity, unsigned needed, size_t element_size)
+{
+    if (needed <= *capacity)
+        return data;
+
+    unsigned new_capacity = *capacity ? *capacity : 64;
+
+    while (new_capacity < needed)
+        new_capacity *= 2;
+
+    data = realloc(data, new_capacity * element_size);
+    assert(data);
+    *capacity = new_capacity;
+    return data;
+}
+
+// Continues hash over size bytes of data, a word at a time. Only meant to tell whether data
+// changed, not to resist anyone trying to make it collide.
+static uint64_t hash_bytes(uint64_t hash, const void* data, size_t size)
+{
+    const unsigned char* bytes = (const unsigned char*)data;
+
+    for (; size >= sizeof(uint64_t); size -= sizeof(uint64_t), bytes += sizeof(uint64_t))
+    {
+        uint64_t word;
+        memcpy(&word, bytes, sizeof(word));
+        hash = (hash ^ word) * 0x9e3779b97f4a7c15ull;
+        hash ^= hash >> 29;
+    }
+
+    for (; size > 0; --size, ++bytes)
+        hash = (hash ^ *bytes) * 0x100000001b3ull;
+
+    return hash;
+}
+
+// Seconds since some fixed point in the past, from the performance counter.
+static double clock_seconds()
+{
+    LARGE_INTEGER now;
+
+    if (g_clock_frequency.QuadPart == 0)
+        QueryPerformanceFrequency(&g_clock_frequency);
+
+    QueryPerformanceCounter(&now);
+    return (double)now.QuadPart / (double)g_clock_frequency.QuadPart;
+}
+
+// Adds the seconds since start to the current frame's timing.
+static void add_frame_timing(FrameTiming timing, double start)
+{
+    g_frame_timing[timing] += clock_seconds() - start;
 }
 
-static LoadedFile load_file(const char* filename)
+// Stores the current frame's timings in the history and starts timing the next frame. The
+// first frame starts here, so nothing is stored for it.
+static void end_frame_timing()
 {
-    LoadedFile lf = {0};
-    FILE* fp = fopen(filename, "rb");
+    double now = clock_seconds();
 
-    if (!fp)
-        return lf;
+    if (g_frame_start != 0)
+    {
+        float* stats = g_frame_stats[g_num_frame_stats++ % FRAME_STATS_HISTORY];
+        double frame = now - g_frame_start;
+        double recording = frame - g_frame_timing[FRAME_TIMING_EVENTS] - g_frame_timing[FRAME_TIMING_SUBMISSION] - g_frame_timing[FRAME_TIMING_PRESENT] - g_frame_timing[FRAME_TIMING_IDLE];
+        g_frame_timing[FRAME_TIMING_RECORDING] = recording > 0 ? recording : 0;
+        g_frame_timing[FRAME_TIMING_FRAME] = frame;
+
+        for (unsigned i = 0; i < NUM_FRAME_TIMINGS; ++i)
+            stats[i] = (float)g_frame_timing[i];
+    }
+
+    memset(g_frame_timing, 0, sizeof(g_frame_timing));
+    g_frame_start = now;
+}
+
+static int compare_floats(const void* a, const void* b)
+{
+    float x = *(const float*)a;
+    float y = *(const float*)b;
+    return (x > y) - (x < y);
+}
 
-    fseek(fp, 0, SEEK_END);
-    lf.size = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-    lf.data = (char*)malloc(lf.size + 1);
+// Finds the average and the 50th, 95th and 99th percentiles of a timing over the frames in
+// the history, in that order. Percentiles are the nearest ranks. Returns how many frames
+// there were.
+static unsigned frame_stats(FrameTiming timing, float* out)
+{
+    static float sorted[FRAME_STATS_HISTORY];
+    static const float percentiles[] = { 0.5f, 0.95f, 0.99f };
+    unsigned count = g_num_frame_stats < FRAME_STATS_HISTORY ? g_num_frame_stats : FRAME_STATS_HISTORY;
+    memset(out, 0, 4 * sizeof(float));
+
+    if (count == 0)
+        return 0;
+
+    for (unsigned i = 0; i < count; ++i)
+    {
+        sorted[i] = g_frame_stats[i][timing];
+        out[0] += sorted[i] / count;
+    }
 
-    if (!lf.data)
-        return lf;
+    qsort(sorted, count, sizeof(float), compare_floats);
+
+    for (unsigned i = 0; i < 3; ++i)
+    {
+        unsigned rank = (unsigned)ceilf(percentiles[i] * count);
+        out[i + 1] = sorted[rank > 0 ? rank - 1 : 0];
+    }
 
-    fread(lf.data, 1, lf.size, fp);
-    lf.data[lf.size] = 0;
-    fclose(fp);
-    lf.loaded = 1;
-    return lf;
+    return count;
 }
 
 static GLuint compile_glsl(const char* shader_source, GLenum shader_type)
@@ -98,16 +937,20 @@ static GLuint load_shader(const char* vertex_source, const char* fragment_source
     return program;
 }
 
-static void recalculate_projection_matrix()
+// Projects the window onto the middle of a render target margin pixels larger on every side,
+// at the same scale. A margin of 0 projects onto the window itself.
+static void recalculate_projection_matrix(unsigned margin)
 {
     memset(g_projection_matrix, 0, sizeof(g_projection_matrix));
     static const float near_plane = -1;
     static const float far_plane = 1;
-    g_projection_matrix[0] = 2.0f / (g_window_width - 1.0f);
-    g_projection_matrix[5] = -2.0f / (g_window_height - 1.0f);
+    float width = g_window_width + 2.0f * margin;
+    float height = g_window_height + 2.0f * margin;
+    g_projection_matrix[0] = 2.0f * g_window_width / ((g_window_width - 1.0f) * width);
+    g_projection_matrix[5] = -2.0f * g_window_height / ((g_window_height - 1.0f) * height);
     g_projection_matrix[10] = 2.0f / (far_plane / near_plane);
-    g_projection_matrix[12] = -1;
-    g_projection_matrix[13] = 1;
+    g_projection_matrix[12] = 2.0f * margin / width - 1;
+    g_projection_matrix[13] = 1 - 2.0f * margin / height;
     g_projection_matrix[14] = (near_plane + far_plane) / (near_plane - far_plane);
     g_projection_matrix[15] = 1;
 }
@@ -116,7 +959,9 @@ static void set_window_size(unsigned window_width, unsigned window_height)
 {
     g_window_width = window_width;
     g_window_height = window_height;
-    recalculate_projection_matrix();
+    recalculate_projection_matrix(0);
+    g_camera_dirty = 1;
+    g_frame_dirty = 1;
     glViewport(0, 0, window_width, window_height);
 }
 
@@ -234,214 +1079,2808 @@ static LRESULT CALLBACK window_proc(HWND hwnd, UINT message, WPARAM wparam, LPAR
     }
 }
 
-static void init(const char* window_title, unsigned window_width, unsigned window_height, int fullscreen)
+static void use_program(GLuint program)
 {
-    g_window_closed = 0;
-    HINSTANCE h = GetModuleHandle(NULL);
-    WNDCLASS wc = {0};    
-    GLuint vao;
-    int border_width = GetSystemMetrics(SM_CXFIXEDFRAME);
-    int h_border_thickness = GetSystemMetrics(SM_CXSIZEFRAME) + border_width;
-    int v_border_thickness = GetSystemMetrics(SM_CYSIZEFRAME) + border_width;
-    int caption_thickness = GetSystemMetrics(SM_CYCAPTION) + GetSystemMetrics(SM_CXPADDEDBORDER);
+    if (g_state.program == program)
+        return;
 
-    PIXELFORMATDESCRIPTOR pfd =
-    {
-        sizeof(PIXELFORMATDESCRIPTOR),
-        1,
-        PFD_DRAW_TO_WINDOW | PFD_SUPPORT_OPENGL | PFD_DOUBLEBUFFER,
-        PFD_TYPE_RGBA,            //The kind of framebuffer. RGBA or palette.
-        32,                       //Colordepth of the framebuffer.
-        0, 0, 0, 0, 0, 0,
-        0,
-        0,
-        0,
-        0, 0, 0, 0,
-        32,                       //Number of bits for the depthbuffer
-        8,                        //Number of bits for the stencilbuffer
-        0,                        //Number of Aux buffers in the framebuffer.
-        PFD_MAIN_PLANE,
-        0,
-        0, 0, 0
-    };
+    glUseProgram(program);
+    g_state.program = program;
+}
 
-    mat_ident(g_view_matrix);
-    g_mouse_x = 0;
-    g_mouse_y = 0;
-    g_mouse_left_down = 0;
-    g_mouse_right_down = 0;
-    memset(g_held_keys, 0, sizeof(g_held_keys));
-    memset(g_free_shapes, 1, sizeof(g_free_shapes));
-    wc.hInstance = h;
-    wc.lpfnWndProc = window_proc;
-    wc.hbrBackground = (HBRUSH)(COLOR_BACKGROUND);
-    wc.lpszClassName = window_title;
-    wc.style = CS_OWNDC;
-    RegisterClass(&wc);
-    g_window_handle = CreateWindow(window_title, window_title, WS_OVERLAPPEDWINDOW | WS_VISIBLE, 0, 0, window_width + 2 * h_border_thickness,window_height + 2 * v_border_thickness + caption_thickness, 0, 0, h, 0);
-    g_device_context = GetDC(g_window_handle);
-    SetPixelFormat(g_device_context, ChoosePixelFormat(g_device_context, &pfd), &pfd);
-    g_rendering_context = wglCreateContext(g_device_context);
-    wglMakeCurrent(g_device_context, g_rendering_context);
-    gl3wInit();
-    glGenVertexArrays(1, &vao);
-    glBindVertexArray(vao);
-    glDisable(GL_DEPTH_TEST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    LoadedFile vertex_shader = load_file("vertex_shader.glsl");
-    assert(vertex_shader.loaded);
-    LoadedFile fragment_shader = load_file("fragment_shader.glsl");
-    assert(fragment_shader.loaded);
-    g_shader = load_shader(vertex_shader.data, fragment_shader.data);
-    free(vertex_shader.data);
-    free(fragment_shader.data);
-    assert(glIsProgram(g_shader));
-    g_model_view_projection_matrix_location = glGetUniformLocation(g_shader, "model_view_projection_matrix");
-    set_window_size(window_width, window_height);
-    wglGetProcAddress("wglSwapIntervalEXT")(-1);
+static void bind_vertex_array(GLuint vertex_array)
+{
+    if (g_state.vertex_array == vertex_array)
+        return;
 
-    if (fullscreen)
+    glBindVertexArray(vertex_array);
+    g_state.vertex_array = vertex_array;
+}
+
+static void bind_buffer(GLenum target, GLuint buffer)
+{
+    for (unsigned i = 0; i < NUM_CACHED_BUFFER_TARGETS; ++i)
     {
-        DEVMODE settings;
-        memset(&settings, 0, sizeof(settings));
-        settings.dmSize = sizeof(settings);
-        settings.dmPelsWidth = window_width;
-        settings.dmPelsHeight = window_height;
-        settings.dmBitsPerPel = 32;
-        settings.dmFields = DM_BITSPERPEL | DM_PELSWIDTH | DM_PELSHEIGHT;
-        ChangeDisplaySettings(&settings, CDS_FULLSCREEN);
+        if (cached_buffer_targets[i] != target)
+            continue;
 
-        LONG ex_style = GetWindowLong(g_window_handle, GWL_EXSTYLE);
-        LONG style = GetWindowLong(g_window_handle, GWL_STYLE);
+        if (g_state.buffers[i] == buffer)
+            return;
 
-        ex_style &= ~(WS_EX_DLGMODALFRAME | WS_EX_CLIENTEDGE | WS_EX_STATICEDGE);
-        style &= ~(WS_CAPTION | WS_THICKFRAME | WS_MINIMIZE | WS_MAXIMIZE | WS_SYSMENU);
+        g_state.buffers[i] = buffer;
+        break;
+    }
 
-        SetWindowLong(g_window_handle, GWL_EXSTYLE, ex_style);
-        SetWindowLong(g_window_handle, GWL_STYLE, style);
+    glBindBuffer(target, buffer);
+}
 
-        SetWindowPos(g_window_handle,
-            0,
-            0, 0,
-            window_width, window_height,
-            SWP_NOZORDER | SWP_FRAMECHANGED);
+static void delete_buffer(GLuint* buffer)
+{
+    for (unsigned i = 0; i < NUM_CACHED_BUFFER_TARGETS; ++i)
+    {
+        if (g_state.buffers[i] == *buffer)
+            g_state.buffers[i] = 0;
     }
+
+    if (g_state.instance_buffer == *buffer)
+        g_state.instance_buffer = 0;
+
+    glDeleteBuffers(1, buffer);
+    *buffer = 0;
 }
 
-static void deinit()
+static void set_capability(GLenum capability, int enabled)
 {
-    DestroyWindow(g_window_handle);
+    for (unsigned i = 0; i < NUM_CACHED_CAPABILITIES; ++i)
+    {
+        if (cached_capabilities[i] != capability)
+            continue;
+
+        if (g_state.capabilities[i] == enabled)
+            return;
+
+        g_state.capabilities[i] = enabled;
+        break;
+    }
+
+    if (enabled)
+        glEnable(capability);
+    else
+        glDisable(capability);
 }
 
-static void process_events()
+// Makes sure the arena can hold needed more elements. Growing allocates a bigger buffer and
+// copies the old contents over on the GPU, so the CPU never needs to keep geometry around.
+static void reserve_arena(Arena* arena, unsigned needed)
 {
-    MSG msg = {0};
+    if (arena->used + needed <= arena->capacity)
+        return;
 
-    while(PeekMessage(&msg,0,0,0,PM_REMOVE))
+    unsigned new_capacity = arena->capacity ? arena->capacity : 1024;
+
+    while (new_capacity < arena->used + needed)
+        new_capacity *= 2;
+
+    GLuint new_buffer;
+    glGenBuffers(1, &new_buffer);
+    bind_buffer(GL_COPY_WRITE_BUFFER, new_buffer);
+    glBufferData(GL_COPY_WRITE_BUFFER, new_capacity * arena->element_size, NULL, GL_STATIC_DRAW);
+
+    if (arena->buffer)
     {
-        TranslateMessage(&msg);
-        DispatchMessage(&msg);
+        bind_buffer(GL_COPY_READ_BUFFER, arena->buffer);
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, arena->used * arena->element_size);
+        delete_buffer(&arena->buffer);
     }
-}
 
-static void clear(float r, float g, float b)
-{
-    glClearColor(r, g, b, 1.0f);
-    glClear(GL_COLOR_BUFFER_BIT);
+    arena->buffer = new_buffer;
+    arena->capacity = new_capacity;
 }
 
-static void flip()
+static unsigned arena_alloc(Arena* arena, unsigned count)
 {
-    SwapBuffers(g_device_context);
+    reserve_arena(arena, count);
+    unsigned first = arena->used;
+    arena->used += count;
+    return first;
 }
 
-static Handle get_free_shape_handle()
+// Captures the vertex layout of shapes in their vertex array once. Where separate attribute
+// formats are supported (GL 4.3) the layout never has to be specified again, and switching
+// to a grown arena or a new range of instances only swaps a buffer binding.
+static void create_shape_vertex_array()
 {
-    for (unsigned i = 0; i < MAX_SHAPES; ++i)
+    glGenVertexArrays(1, &g_shape_vertex_array);
+    bind_vertex_array(g_shape_vertex_array);
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
+    glEnableVertexAttribArray(2);
+    glEnableVertexAttribArray(3);
+    glEnableVertexAttribArray(4);
+    glEnableVertexAttribArray(5);
+
+    if (glVertexAttribFormat)
     {
-        if (g_free_shapes[i])
-        {
-            g_free_shapes[i] = 0;
-            return i;
-        }
+        glVertexAttribFormat(0, 2, GL_FLOAT, GL_FALSE, 0);
+        glVertexAttribBinding(0, 0);
+        glVertexAttribFormat(1, 3, GL_FLOAT, GL_FALSE, 2 * sizeof(float));
+        glVertexAttribBinding(1, 0);
+        glVertexAttribFormat(2, 4, GL_FLOAT, GL_FALSE, 0);
+        glVertexAttribBinding(2, 1);
+        glVertexAttribFormat(3, 4, GL_UNSIGNED_BYTE, GL_TRUE, 4 * sizeof(float));
+        glVertexAttribBinding(3, 1);
+        glVertexAttribFormat(4, 1, GL_FLOAT, GL_FALSE, 4 * sizeof(float) + 4);
+        glVertexAttribBinding(4, 1);
+        glVertexAttribFormat(5, 4, GL_FLOAT, GL_FALSE, offsetof(Instance, params));
+        glVertexAttribBinding(5, 1);
+        glVertexBindingDivisor(1, 1);
+    }
+    else
+    {
+        glVertexAttribDivisor(2, 1);
+        glVertexAttribDivisor(3, 1);
+        glVertexAttribDivisor(4, 1);
+        glVertexAttribDivisor(5, 1);
     }
-
-    return (Handle)-1;
 }
 
-static Handle add_shape(float* verts, int n)
+// Points the shape vertex array at the arenas. Has to be redone whenever an arena grows,
+// since that replaces its buffer.
+static void bind_shape_vertex_layout()
 {
-    Handle handle = get_free_shape_handle();
-    assert(handle != -1);
-    GLuint geometry_handle;
-    glGenBuffers(1, &geometry_handle);
-    glBindBuffer(GL_ARRAY_BUFFER, geometry_handle);
-    glBufferData(GL_ARRAY_BUFFER, n * floats_per_vertex * sizeof(float), verts, GL_STATIC_DRAW);
-    Shape shape = { geometry_handle, n };
-    g_shapes[handle] = shape;
-    return handle;
+    bind_vertex_array(g_shape_vertex_array);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, g_index_arena.buffer);
+
+    if (glBindVertexBuffer)
+    {
+        glBindVertexBuffer(0, g_vertex_arena.buffer, 0, floats_per_vertex * sizeof(float));
+        return;
+    }
+
+    bind_buffer(GL_ARRAY_BUFFER, g_vertex_arena.buffer);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, floats_per_vertex * sizeof(float), (void*)0);
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, floats_per_vertex * sizeof(float), (void*)(2 * sizeof(float)));
 }
 
-static void mat_mul(const float* m1, const float* m2, float* out)
+static void bind_instances(GLuint buffer, size_t offset)
 {
-    out[0] = m1[0] * m2[0] + m1[1] * m2[4] + m1[2] * m2[8] + m1[3] * m2[12];
-    out[1] = m1[0] * m2[1] + m1[1] * m2[5] + m1[2] * m2[9] + m1[3] * m2[13];
-    out[2] = m1[0] * m2[2] + m1[1] * m2[6] + m1[2] * m2[10] + m1[3] * m2[14];
-    out[3] = m1[0] * m2[3] + m1[1] * m2[7] + m1[2] * m2[11] + m1[3] * m2[15];
+    if (g_state.instance_buffer == buffer && g_state.instance_offset == offset)
+        return;
 
-    out[4] = m1[4] * m2[0] + m1[5] * m2[4] + m1[6] * m2[8] + m1[7] * m2[12];
-    out[5] = m1[4] * m2[1] + m1[5] * m2[5] + m1[6] * m2[9] + m1[7] * m2[13];
-    out[6] = m1[4] * m2[2] + m1[5] * m2[6] + m1[6] * m2[10] + m1[7] * m2[14];
-    out[7] = m1[4] * m2[3] + m1[5] * m2[7] + m1[6] * m2[11] + m1[7] * m2[15];
+    g_state.instance_buffer = buffer;
+    g_state.instance_offset = offset;
+    bind_vertex_array(g_shape_vertex_array);
 
-    out[8] = m1[8] * m2[0] + m1[9] * m2[4] + m1[10] * m2[8] + m1[11] * m2[12];
-    out[9] = m1[8] * m2[1] + m1[9] * m2[5] + m1[10] * m2[9] + m1[11] * m2[13];
-    out[10] = m1[8] * m2[2] + m1[9] * m2[6] + m1[10] * m2[10] + m1[11] * m2[14];
-    out[11] = m1[8] * m2[3] + m1[9] * m2[7] + m1[10] * m2[11] + m1[11] * m2[15];
+    if (glBindVertexBuffer)
+    {
+        glBindVertexBuffer(1, buffer, offset, sizeof(Instance));
+        return;
+    }
 
-    out[12] = m1[12] * m2[0] + m1[13] * m2[4] + m1[14] * m2[8] + m1[15] * m2[12];
-    out[13] = m1[12] * m2[1] + m1[13] * m2[5] + m1[14] * m2[9] + m1[15] * m2[13];
-    out[14] = m1[12] * m2[2] + m1[13] * m2[6] + m1[14] * m2[10] + m1[15] * m2[14];
-    out[15] = m1[12] * m2[3] + m1[13] * m2[7] + m1[14] * m2[11] + m1[15] * m2[15];
+    bind_buffer(GL_ARRAY_BUFFER, buffer);
+    glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, sizeof(Instance), (void*)offset);
+    glVertexAttribPointer(3, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(Instance), (void*)(offset + 4 * sizeof(float)));
+    glVertexAttribPointer(4, 1, GL_FLOAT, GL_FALSE, sizeof(Instance), (void*)(offset + 4 * sizeof(float) + 4));
+    glVertexAttribPointer(5, 4, GL_FLOAT, GL_FALSE, sizeof(Instance), (void*)(offset + offsetof(Instance, params)));
 }
 
-static void draw_shape(Handle handle, float x, float y)
+static void wait_for_fence(GLsync* fence)
 {
-    glUseProgram(g_shader);
-    Shape* shape = g_shapes + handle;
-    glBindBuffer(GL_ARRAY_BUFFER, shape->geometry_handle);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, floats_per_vertex * sizeof(float), (void*)0);
-    glEnableVertexAttribArray(1);
-    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, floats_per_vertex * sizeof(float), (void*)(2 * sizeof(float)));
-    static float model_view_projection_matrix[16];
-    static float model_view_matrix[16];
-    static float model_matrix[16];
-    mat_ident(model_matrix);
-    model_matrix[12] = x;
-    model_matrix[13] = y;
-    mat_mul(model_matrix, g_view_matrix, model_view_matrix);
-    mat_mul(model_view_matrix, g_projection_matrix, model_view_projection_matrix);
-    glUniformMatrix4fv(g_model_view_projection_matrix_location, 1, GL_FALSE, model_view_projection_matrix);
-    glDrawArrays(GL_TRIANGLE_FAN, 0, shape->count);
-}
+    if (!*fence)
+        return;
 
-static void move_view(float x, float y)
-{
-    g_view_matrix[12] -= x;
-    g_view_matrix[13] -= y;
+    glClientWaitSync(*fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+    glDeleteSync(*fence);
+    *fence = 0;
 }
 
-//////
-// Expose lua API.
-
-static int is_window_open()
+static void create_stream_ring(StreamRing* ring, unsigned region_size)
 {
-    return IsWindow(g_window_handle) && g_window_closed != 1;
+    ring->region_size = region_size;
+    ring->offset = 0;
+    ring->committed = 0;
+    glGenBuffers(1, &ring->buffer);
+    bind_buffer(GL_COPY_WRITE_BUFFER, ring->buffer);
+
+    if (glBufferStorage)
+    {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(GL_COPY_WRITE_BUFFER, STREAM_FRAMES * region_size, NULL, flags);
+        ring->mapped = (char*)glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, STREAM_FRAMES * region_size, flags);
+        ring->staging = NULL;
+    }
+    else
+    {
+        glBufferData(GL_COPY_WRITE_BUFFER, STREAM_FRAMES * region_size, NULL, GL_STREAM_DRAW);
+        ring->mapped = NULL;
+        ring->staging = (char*)malloc(region_size);
+    }
 }
 
-static int pvx_init(lua_State* L)
+static void destroy_stream_ring(StreamRing* ring)
+{
+    for (unsigned i = 0; i < STREAM_FRAMES; ++i)
+        wait_for_fence(ring->fences + i);
+
+    if (ring->mapped)
+    {
+        bind_buffer(GL_COPY_WRITE_BUFFER, ring->buffer);
+        glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+    }
+
+    delete_buffer(&ring->buffer);
+    free(ring->staging);
+}
+
+// Returns memory for size bytes of this frame's data and its offset in the ring buffer.
+// Running out of space in the current region replaces the ring with a larger one, which
+// is the only time streaming waits for the GPU.
+static void* stream_alloc(StreamRing* ring, unsigned size, size_t* offset)
+{
+    static const unsigned alignment = 256;
+    unsigned start = (ring->offset + alignment - 1) & ~(alignment - 1);
+
+    if (start + size > ring->region_size)
+    {
+        unsigned region_size = ring->region_size * 2;
+
+        while (region_size < size)
+            region_size *= 2;
+
+        destroy_stream_ring(ring);
+        create_stream_ring(ring, region_size);
+        ring->region = 0;
+        start = 0;
+    }
+
+    ring->offset = start + size;
+    *offset = ring->region * ring->region_size + start;
+    return (ring->mapped ? ring->mapped + *offset : ring->staging + start);
+}
+
+// Makes everything allocated so far visible to the GPU.
+static void stream_commit(StreamRing* ring)
+{
+    if (ring->mapped || ring->committed == ring->offset)
+        return;
+
+    GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT;
+    unsigned size = ring->offset - ring->committed;
+    bind_buffer(GL_COPY_WRITE_BUFFER, ring->buffer);
+    void* dest = glMapBufferRange(GL_COPY_WRITE_BUFFER, ring->region * ring->region_size + ring->committed, size, flags);
+    memcpy(dest, ring->staging + ring->committed, size);
+    glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+    ring->committed = ring->offset;
+}
+
+// Writes count elements starting at first. Streamed writes go through the ring and are
+// copied into place on the GPU, which keeps the copy ordered after any draw already
+// submitted that still reads the old contents, without stalling the CPU.
+static void arena_write(Arena* arena, unsigned first, const void* data, unsigned count, int streamed)
+{
+    unsigned size = count * arena->element_size;
+
+    if (!streamed)
+    {
+        bind_buffer(GL_COPY_WRITE_BUFFER, arena->buffer);
+        glBufferSubData(GL_COPY_WRITE_BUFFER, first * arena->element_size, size, data);
+        return;
+    }
+
+    size_t offset;
+    memcpy(stream_alloc(&g_stream, size, &offset), data, size);
+    stream_commit(&g_stream);
+    bind_buffer(GL_COPY_READ_BUFFER, g_stream.buffer);
+    bind_buffer(GL_COPY_WRITE_BUFFER, arena->buffer);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, offset, first * arena->element_size, size);
+}
+
+static void stream_end_frame(StreamRing* ring)
+{
+    ring->fences[ring->region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    ring->region = (ring->region + 1) % STREAM_FRAMES;
+    ring->offset = 0;
+    ring->committed = 0;
+    wait_for_fence(ring->fences + ring->region);
+}
+
+// Every program that needs the camera reads it from the same uniform buffer range, so the
+// camera is written once per submission no matter how many programs use it.
+static const GLuint camera_binding = 0;
+static const unsigned camera_size = 20 * sizeof(float);
+
+static void use_camera_block(GLuint program)
+{
+    glUniformBlockBinding(program, glGetUniformBlockIndex(program, "Camera"), camera_binding);
+}
+
+// Adaptive vsync needs WGL_EXT_swap_control_tear, without it vsync is used instead.
+static void set_present_mode(PresentMode mode)
+{
+    static const int swap_intervals[] = { 1, -1, 0 };
+    PROC swap_interval = wglGetProcAddress("wglSwapIntervalEXT");
+
+    if (!swap_interval)
+        return;
+
+    if (!swap_interval(swap_intervals[mode]) && mode == PRESENT_MODE_ADAPTIVE)
+        swap_interval(1);
+}
+
+// Makes flip hold every frame until frame_time seconds after the one before, 0 turns it
+// off. The system timer is made to tick every millisecond meanwhile, so that sleeping
+// overshoots as little as it can.
+static void set_frame_limit(double frame_time)
+{
+    if (frame_time > 0 && g_target_frame_time <= 0)
+        timeBeginPeriod(1);
+    else if (frame_time <= 0 && g_target_frame_time > 0)
+        timeEndPeriod(1);
+
+    g_target_frame_time = frame_time > 0 ? frame_time : 0;
+    g_frame_deadline = 0;
+    g_num_pacing_errors = 0;
+}
+
+// Waits for the frame limit's next deadline. Sleeping is only precise to a millisecond or
+// so, so it stops limiter_spin_time early and spins the rest of the way. A frame that ran
+// more than a whole frame late starts the schedule over instead of rushing to catch up.
+// How far each frame ended up from the target frame time is kept for frame_pacing.
+static void limit_frame_rate()
+{
+    if (g_target_frame_time <= 0)
+        return;
+
+    double now = clock_seconds();
+    double previous = g_frame_deadline;
+    double deadline = previous + g_target_frame_time;
+
+    if (previous == 0)
+    {
+        g_frame_deadline = now;
+        return;
+    }
+
+    if (now > deadline + g_target_frame_time)
+        deadline = now;
+
+    while (deadline - now > limiter_spin_time)
+    {
+        Sleep((DWORD)((deadline - now - limiter_spin_time) * 1000));
+        now = clock_seconds();
+    }
+
+    while (now < deadline)
+        now = clock_seconds();
+
+    g_pacing_errors[g_num_pacing_errors++ % PACING_HISTORY] = (float)(now - previous - g_target_frame_time);
+    g_frame_deadline = deadline;
+}
+
+// Finds the average and the largest amount of seconds that the last PACING_HISTORY frames
+// were off from the frame limit.
+static void frame_pacing(float* average, float* worst)
+{
+    unsigned count = g_num_pacing_errors < PACING_HISTORY ? g_num_pacing_errors : PACING_HISTORY;
+    *average = 0;
+    *worst = 0;
+
+    for (unsigned i = 0; i < count; ++i)
+    {
+        float error = fabsf(g_pacing_errors[i]);
+        *average += error / count;
+        *worst = error > *worst ? error : *worst;
+    }
+}
+
+static void init(const char* window_title, unsigned window_width, unsigned window_height, int fullscreen)
+{
+    g_window_closed = 0;
+    HINSTANCE h = GetModuleHandle(NULL);
+    WNDCLASS wc = {0};    
+    int border_width = GetSystemMetrics(SM_CXFIXEDFRAME);
+    int h_border_thickness = GetSystemMetrics(SM_CXSIZEFRAME) + border_width;
+    int v_border_thickness = GetSystemMetrics(SM_CYSIZEFRAME) + border_width;
+    int caption_thickness = GetSystemMetrics(SM_CYCAPTION) + GetSystemMetrics(SM_CXPADDEDBORDER);
+
+    PIXELFORMATDESCRIPTOR pfd =
+    {
+        sizeof(PIXELFORMATDESCRIPTOR),
+        1,
+        PFD_DRAW_TO_WINDOW | PFD_SUPPORT_OPENGL | PFD_DOUBLEBUFFER,
+        PFD_TYPE_RGBA,            //The kind of framebuffer. RGBA or palette.
+        32,                       //Colordepth of the framebuffer.
+        0, 0, 0, 0, 0, 0,
+        0,
+        0,
+        0,
+        0, 0, 0, 0,
+        32,                       //Number of bits for the depthbuffer
+        8,                        //Number of bits for the stencilbuffer
+        0,                        //Number of Aux buffers in the framebuffer.
+        PFD_MAIN_PLANE,
+        0,
+        0, 0, 0
+    };
+
+    g_view_position[0] = 0;
+    g_view_position[1] = 0;
+    g_view_zoom = 1;
+    g_view_rotation = 0;
+    memset(g_tint, 255, sizeof(g_tint));
+    g_layer = NO_LAYER;
+    g_depth_layering = 0;
+    g_mouse_x = 0;
+    g_mouse_y = 0;
+    g_mouse_left_down = 0;
+    g_mouse_right_down = 0;
+    memset(g_held_keys, 0, sizeof(g_held_keys));
+    memset(g_free_shapes, 1, sizeof(g_free_shapes));
+    g_quad_shape = MAX_SHAPES;
+    memset(&g_atlas, 0, sizeof(g_atlas));
+    memset(&g_glyph_cache, 0, sizeof(g_glyph_cache));
+    g_num_layer_caches = 0;
+    g_open_layer_cache = NO_LAYER_CACHE;
+    g_recording_layer_cache = NO_LAYER_CACHE;
+    g_num_images = 0;
+    wc.hInstance = h;
+    wc.lpfnWndProc = window_proc;
+    wc.hbrBackground = (HBRUSH)(COLOR_BACKGROUND);
+    wc.lpszClassName = window_title;
+    wc.style = CS_OWNDC;
+    RegisterClass(&wc);
+    g_window_handle = CreateWindow(window_title, window_title, WS_OVERLAPPEDWINDOW | WS_VISIBLE, 0, 0, window_width + 2 * h_border_thickness,window_height + 2 * v_border_thickness + caption_thickness, 0, 0, h, 0);
+    g_device_context = GetDC(g_window_handle);
+    SetPixelFormat(g_device_context, ChoosePixelFormat(g_device_context, &pfd), &pfd);
+    g_rendering_context = wglCreateContext(g_device_context);
+    wglMakeCurrent(g_device_context, g_rendering_context);
+    gl3wInit();
+    memset(&g_state, 0, sizeof(g_state));
+    create_shape_vertex_array();
+    glDisable(GL_DEPTH_TEST);
+    glDepthFunc(GL_LEQUAL);
+    g_programs[PROGRAM_SHAPE] = load_shader(shape_vertex_shader_source, shape_fragment_shader_source);
+    g_programs[PROGRAM_PRIMITIVE] = load_shader(primitive_vertex_shader_source, primitive_fragment_shader_source);
+    g_programs[PROGRAM_LINE] = load_shader(line_vertex_shader_source, line_fragment_shader_source);
+    g_programs[PROGRAM_SPRITE] = load_shader(sprite_vertex_shader_source, sprite_fragment_shader_source);
+    g_programs[PROGRAM_TEXT] = load_shader(text_vertex_shader_source, text_fragment_shader_source);
+
+    for (unsigned i = 0; i < NUM_PROGRAMS; ++i)
+    {
+        assert(glIsProgram(g_programs[i]));
+        use_camera_block(g_programs[i]);
+    }
+
+    // The sprite atlas stays bound to texture unit 0 and the glyph atlas to unit 1, layer
+    // caches are bound to unit 2 when composited.
+    use_program(g_programs[PROGRAM_TEXT]);
+    glUniform1i(glGetUniformLocation(g_programs[PROGRAM_TEXT], "glyphs"), 1);
+    g_layer_cache_program = load_shader(layer_cache_vertex_shader_source, layer_cache_fragment_shader_source);
+    assert(glIsProgram(g_layer_cache_program));
+    use_program(g_layer_cache_program);
+    glUniform1i(glGetUniformLocation(g_layer_cache_program, "layer"), 2);
+    g_layer_cache_rect_location = glGetUniformLocation(g_layer_cache_program, "rect");
+
+    if (glQueryCounter)
+    {
+        for (unsigned i = 0; i < GPU_TIMER_FRAMES; ++i)
+            glGenQueries(MAX_GPU_TIMESTAMPS, g_gpu_timers[i].queries);
+    }
+
+    g_camera_dirty = 1;
+    memset(&g_vertex_arena, 0, sizeof(g_vertex_arena));
+    memset(&g_index_arena, 0, sizeof(g_index_arena));
+    g_vertex_arena.element_size = floats_per_vertex * sizeof(float);
+    g_index_arena.element_size = sizeof(GLuint);
+    reserve_arena(&g_vertex_arena, 4096);
+    reserve_arena(&g_index_arena, 4096 * 3);
+    memset(&g_stream, 0, sizeof(g_stream));
+    create_stream_ring(&g_stream, 1024 * 1024);
+    bind_shape_vertex_layout();
+    g_num_draws = 0;
+    g_flush_count = 1;
+    // Alpha is blended separately so that render targets with alpha of their own, like
+    // layer caches, end up holding premultiplied colors.
+    glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+    set_window_size(window_width, window_height);
+    set_present_mode(PRESENT_MODE_ADAPTIVE);
+    int refresh_rate = GetDeviceCaps(g_device_context, VREFRESH);
+    g_refresh_interval = refresh_rate > 1 ? 1000 / refresh_rate : 16;
+
+    if (fullscreen)
+    {
+        DEVMODE settings;
+        memset(&settings, 0, sizeof(settings));
+        settings.dmSize = sizeof(settings);
+        settings.dmPelsWidth = window_width;
+        settings.dmPelsHeight = window_height;
+        settings.dmBitsPerPel = 32;
+        settings.dmFields = DM_BITSPERPEL | DM_PELSWIDTH | DM_PELSHEIGHT;
+        ChangeDisplaySettings(&settings, CDS_FULLSCREEN);
+
+        LONG ex_style = GetWindowLong(g_window_handle, GWL_EXSTYLE);
+        LONG style = GetWindowLong(g_window_handle, GWL_STYLE);
+
+        ex_style &= ~(WS_EX_DLGMODALFRAME | WS_EX_CLIENTEDGE | WS_EX_STATICEDGE);
+        style &= ~(WS_CAPTION | WS_THICKFRAME | WS_MINIMIZE | WS_MAXIMIZE | WS_SYSMENU);
+
+        SetWindowLong(g_window_handle, GWL_EXSTYLE, ex_style);
+        SetWindowLong(g_window_handle, GWL_STYLE, style);
+
+        SetWindowPos(g_window_handle,
+            0,
+            0, 0,
+            window_width, window_height,
+            SWP_NOZORDER | SWP_FRAMECHANGED);
+    }
+}
+
+static void deinit()
+{
+    set_frame_limit(0);
+    DestroyWindow(g_window_handle);
+}
+
+// Blocks until a message is queued or timeout milliseconds have passed. Messages that were
+// queued but not yet handled count too. Returns 1 if there is a message.
+static int wait_for_message(DWORD timeout)
+{
+    MSG msg;
+
+    if (PeekMessage(&msg, 0, 0, 0, PM_NOREMOVE))
+        return 1;
+
+    double start = clock_seconds();
+    int woken = MsgWaitForMultipleObjectsEx(0, NULL, timeout, QS_ALLINPUT, MWMO_INPUTAVAILABLE) == WAIT_OBJECT_0;
+    add_frame_timing(FRAME_TIMING_IDLE, start);
+    return woken;
+}
+
+// Handles all queued messages. While the window is minimized or hidden nothing drawn can be
+// seen, so this first waits up to hidden_event_wait for a message, which slows loops that
+// call it down to a few iterations a second.
+static void process_events()
+{
+    MSG msg = {0};
+
+    if (IsIconic(g_window_handle) || !IsWindowVisible(g_window_handle))
+        wait_for_message(hidden_event_wait);
+
+    double start = clock_seconds();
+
+    while(PeekMessage(&msg,0,0,0,PM_REMOVE))
+    {
+        TranslateMessage(&msg);
+        DispatchMessage(&msg);
+    }
+
+    add_frame_timing(FRAME_TIMING_EVENTS, start);
+}
+
+// Like process_events, but waits for input first, at most timeout milliseconds. Returns 1 if
+// there were messages to handle, 0 if the timeout expired.
+static int wait_events(DWORD timeout)
+{
+    int woken = wait_for_message(timeout);
+    process_events();
+    return woken;
+}
+
+static Handle get_free_shape_handle()
+{
+    for (unsigned i = 0; i < MAX_SHAPES; ++i)
+    {
+        if (g_free_shapes[i])
+        {
+            g_free_shapes[i] = 0;
+            return i;
+        }
+    }
+
+    return (Handle)-1;
+}
+
+static float signed_area(const float* verts, unsigned stride, unsigned first, unsigned n)
+{
+    float area = 0;
+
+    for (unsigned i = 0, j = n - 1; i < n; j = i++)
+    {
+        const float* a = verts + (first + j) * stride;
+        const float* b = verts + (first + i) * stride;
+        area += a[0] * b[1] - b[0] * a[1];
+    }
+
+    return area * 0.5f;
+}
+
+static float cross(const float* o, const float* a, const float* b)
+{
+    return (a[0] - o[0]) * (b[1] - o[1]) - (a[1] - o[1]) * (b[0] - o[0]);
+}
+
+static int point_in_triangle(const float* p, const float* a, const float* b, const float* c)
+{
+    return cross(a, b, p) >= 0 && cross(b, c, p) >= 0 && cross(c, a, p) >= 0;
+}
+
+// Triangulation works on a ring of nodes, each pointing at a vertex. Holes are spliced
+// into the outline through a bridge, which makes the bridge vertices appear twice in the
+// ring but never duplicates any vertex data.
+typedef struct Ring {
+    unsigned* vertex;
+    unsigned* next;
+    unsigned* prev;
+    unsigned size;
+} Ring;
+
+static unsigned ring_push(Ring* ring, unsigned vertex)
+{
+    unsigned node = ring->size++;
+    ring->vertex[node] = vertex;
+    return node;
+}
+
+static void ring_link(Ring* ring, unsigned a, unsigned b)
+{
+    ring->next[a] = b;
+    ring->prev[b] = a;
+}
+
+// Adds the n vertices starting at first as a closed loop with the requested winding and
+// returns the node holding the vertex with the largest x.
+static unsigned ring_add_loop(Ring* ring, const float* verts, unsigned stride, unsigned first, unsigned n, int counter_clockwise)
+{
+    int reverse = (signed_area(verts, stride, first, n) > 0) != counter_clockwise;
+    unsigned start = ring->size;
+    unsigned rightmost = start;
+
+    for (unsigned i = 0; i < n; ++i)
+    {
+        unsigned node = ring_push(ring, first + (reverse ? n - 1 - i : i));
+
+        if (verts[ring->vertex[node] * stride] > verts[ring->vertex[rightmost] * stride])
+            rightmost = node;
+
+        ring_link(ring, node, i == n - 1 ? start : node + 1);
+    }
+
+    return rightmost;
+}
+
+static int locally_inside(const Ring* ring, const float* verts, unsigned stride, unsigned node, const float* p)
+{
+    const float* a = verts + ring->vertex[node] * stride;
+    const float* prev = verts + ring->vertex[ring->prev[node]] * stride;
+    const float* next = verts + ring->vertex[ring->next[node]] * stride;
+
+    if (cross(prev, a, next) < 0)
+        return cross(prev, a, p) >= 0 || cross(a, next, p) >= 0;
+
+    return cross(prev, a, p) >= 0 && cross(a, next, p) >= 0;
+}
+
+// Connects a hole, entered at its rightmost node, to a visible node of the outline by
+// casting a ray towards +x. This is the classic approach described by David Eberly in
+// "Triangulation by Ear Clipping". Returns 0 if the ray hits no edge of the outline, which
+// means the hole lies outside of it, and leaves the hole unconnected.
+static int ring_bridge_hole(Ring* ring, const float* verts, unsigned stride, unsigned outline, unsigned hole)
+{
+    const float* m = verts + ring->vertex[hole] * stride;
+    float closest_x = 3.402823466e+38f;
+    unsigned bridge = (unsigned)-1;
+    unsigned node = outline;
+
+    do
+    {
+        const float* a = verts + ring->vertex[node] * stride;
+        const float* b = verts + ring->vertex[ring->next[node]] * stride;
+
+        if (a[1] != b[1] && ((a[1] <= m[1] && m[1] <= b[1]) || (b[1] <= m[1] && m[1] <= a[1])))
+        {
+            float x = a[0] + (m[1] - a[1]) * (b[0] - a[0]) / (b[1] - a[1]);
+
+            if (x >= m[0] && x < closest_x)
+            {
+                closest_x = x;
+                bridge = a[0] > b[0] ? node : ring->next[node];
+            }
+        }
+
+        node = ring->next[node];
+    } while (node != outline);
+
+    if (bridge == (unsigned)-1)
+        return 0;
+
+    // A reflex vertex inside the triangle formed by the hole vertex, the hit point and the
+    // chosen endpoint would hide that endpoint. Pick the one closest in angle to the ray.
+    float hit[2] = { closest_x, m[1] };
+    const float* p = verts + ring->vertex[bridge] * stride;
+    const float* tri_b = p[1] < m[1] ? p : hit;
+    const float* tri_c = p[1] < m[1] ? hit : p;
+    float best_tan = 3.402823466e+38f;
+    node = outline;
+
+    do
+    {
+        const float* v = verts + ring->vertex[node] * stride;
+        const float* prev = verts + ring->vertex[ring->prev[node]] * stride;
+        const float* next = verts + ring->vertex[ring->next[node]] * stride;
+
+        if (node != bridge && v[0] >= m[0] && cross(prev, v, next) < 0 && point_in_triangle(v, m, tri_b, tri_c))
+        {
+            float dy = v[1] - m[1];
+            float tangent = (dy < 0 ? -dy : dy) / (v[0] - m[0] + 1e-20f);
+
+            if (tangent < best_tan)
+            {
+                best_tan = tangent;
+                bridge = node;
+            }
+        }
+
+        node = ring->next[node];
+    } while (node != outline);
+
+    // Vertices used by earlier bridges appear twice in the ring, each copy owning half of the
+    // original corner. Connect through the copy whose corner the hole actually lies in.
+    p = verts + ring->vertex[bridge] * stride;
+    node = outline;
+
+    do
+    {
+        const float* v = verts + ring->vertex[node] * stride;
+
+        if (v[0] == p[0] && v[1] == p[1] && locally_inside(ring, verts, stride, node, m))
+        {
+            bridge = node;
+            break;
+        }
+
+        node = ring->next[node];
+    } while (node != outline);
+
+    unsigned bridge_copy = ring_push(ring, ring->vertex[bridge]);
+    unsigned hole_copy = ring_push(ring, ring->vertex[hole]);
+    unsigned bridge_next = ring->next[bridge];
+    unsigned hole_prev = ring->prev[hole];
+    ring_link(ring, bridge, hole);
+    ring_link(ring, hole_prev, hole_copy);
+    ring_link(ring, hole_copy, bridge_copy);
+    ring_link(ring, bridge_copy, bridge_next);
+    return 1;
+}
+
+static int is_ear(const Ring* ring, const float* verts, unsigned stride, unsigned node)
+{
+    const float* a = verts + ring->vertex[ring->prev[node]] * stride;
+    const float* b = verts + ring->vertex[node] * stride;
+    const float* c = verts + ring->vertex[ring->next[node]] * stride;
+
+    if (cross(a, b, c) <= 0)
+        return 0;
+
+    for (unsigned other = ring->next[ring->next[node]]; other != ring->prev[node]; other = ring->next[other])
+    {
+        const float* p = verts + ring->vertex[other] * stride;
+
+        if ((p[0] == a[0] && p[1] == a[1]) || (p[0] == b[0] && p[1] == b[1]) || (p[0] == c[0] && p[1] == c[1]))
+            continue;
+
+        if (point_in_triangle(p, a, b, c))
+            return 0;
+    }
+
+    return 1;
+}
+
+typedef struct Hole {
+    unsigned first;
+    unsigned count;
+    float max_x;
+} Hole;
+
+// An outline followed by its holes, all in one vertex array.
+typedef struct Outline {
+    float* verts;
+    unsigned count;
+    Hole* holes;
+    unsigned num_holes;
+} Outline;
+
+static int compare_holes(const void* a, const void* b)
+{
+    float ax = ((const Hole*)a)->max_x;
+    float bx = ((const Hole*)b)->max_x;
+    return ax < bx ? 1 : (ax > bx ? -1 : 0);
+}
+
+// Ear clips the outline made up of the first outline_count vertices, with holes made up of
+// the following vertices. Writes triangle list indices and returns how many were written,
+// which is at most 3 * (vertex count + 2 * hole count - 2).
+static unsigned triangulate(const float* verts, unsigned stride, unsigned outline_count, Hole* holes, unsigned num_holes, GLuint* indices)
+{
+    unsigned max_nodes = outline_count + 2 * num_holes;
+
+    for (unsigned i = 0; i < num_holes; ++i)
+        max_nodes += holes[i].count;
+
+    Ring ring = {0};
+    ring.vertex = (unsigned*)malloc(3 * max_nodes * sizeof(unsigned));
+    ring.next = ring.vertex + max_nodes;
+    ring.prev = ring.next + max_nodes;
+    ring_add_loop(&ring, verts, stride, 0, outline_count, 1);
+
+    for (unsigned i = 0; i < num_holes; ++i)
+    {
+        holes[i].max_x = verts[holes[i].first * stride];
+
+        for (unsigned j = 1; j < holes[i].count; ++j)
+        {
+            float x = verts[(holes[i].first + j) * stride];
+
+            if (x > holes[i].max_x)
+                holes[i].max_x = x;
+        }
+    }
+
+    // Bridging the rightmost holes first guarantees that the ray from a hole never crosses
+    // a hole that has not been merged yet.
+    qsort(holes, num_holes, sizeof(Hole), compare_holes);
+    unsigned unconnected = 0;
+
+    // Holes outside of the outline cut nothing away, they are left out of the ring.
+    for (unsigned i = 0; i < num_holes; ++i)
+    {
+        unsigned hole = ring_add_loop(&ring, verts, stride, holes[i].first, holes[i].count, 0);
+
+        if (!ring_bridge_hole(&ring, verts, stride, 0, hole))
+            unconnected += holes[i].count;
+    }
+
+    unsigned index_count = 0;
+    unsigned remaining = ring.size - unconnected;
+    unsigned node = 0;
+    unsigned stalled = 0;
+
+    while (remaining > 3)
+    {
+        if (is_ear(&ring, verts, stride, node) || stalled > remaining)
+        {
+            // If no ear was found in a full lap the outline self-intersects. Clip anyway so
+            // that the loop always terminates, the result is just not guaranteed to be correct.
+            indices[index_count++] = ring.vertex[ring.prev[node]];
+            indices[index_count++] = ring.vertex[node];
+            indices[index_count++] = ring.vertex[ring.next[node]];
+            ring_link(&ring, ring.prev[node], ring.next[node]);
+            node = ring.next[node];
+            --remaining;
+            stalled = 0;
+            continue;
+        }
+
+        node = ring.next[node];
+        ++stalled;
+    }
+
+    indices[index_count++] = ring.vertex[ring.prev[node]];
+    indices[index_count++] = ring.vertex[node];
+    indices[index_count++] = ring.vertex[ring.next[node]];
+    free(ring.vertex);
+    return index_count;
+}
+
+// Builds the geometry used by stencil filled shapes. Every loop becomes a fan that flips the
+// stencil bits it covers, which makes overlapping and self intersecting parts fill by the
+// even-odd rule without any triangulation. Returns the number of fan indices written.
+static unsigned build_stencil_fill(const float* verts, unsigned n, unsigned outline_count, const Hole* holes, unsigned num_holes, const float* bounds, float* cover, GLuint* indices)
+{
+    unsigned index_count = 0;
+
+    for (unsigned loop = 0; loop <= num_holes; ++loop)
+    {
+        unsigned first = loop == 0 ? 0 : holes[loop - 1].first;
+        unsigned count = loop == 0 ? outline_count : holes[loop - 1].count;
+
+        for (unsigned i = 1; i + 1 < count; ++i)
+        {
+            indices[index_count++] = first;
+            indices[index_count++] = first + i;
+            indices[index_count++] = first + i + 1;
+        }
+    }
+
+    float corners[] = { bounds[0], bounds[1], bounds[2], bounds[1], bounds[2], bounds[3], bounds[0], bounds[3] };
+
+    for (unsigned i = 0; i < cover_vertex_count; ++i)
+    {
+        float* v = cover + i * floats_per_vertex;
+        v[0] = corners[i * 2];
+        v[1] = corners[i * 2 + 1];
+        memcpy(v + 2, verts + 2, 3 * sizeof(float));
+    }
+
+    GLuint cover_indices[] = { n, n + 1, n + 2, n, n + 2, n + 3 };
+    memcpy(indices + index_count, cover_indices, sizeof(cover_indices));
+    return index_count;
+}
+
+static void compute_bounds(const float* verts, unsigned n, float* bounds)
+{
+    bounds[0] = bounds[2] = verts[0];
+    bounds[1] = bounds[3] = verts[1];
+
+    for (unsigned i = 1; i < n; ++i)
+    {
+        const float* v = verts + i * floats_per_vertex;
+        bounds[0] = v[0] < bounds[0] ? v[0] : bounds[0];
+        bounds[1] = v[1] < bounds[1] ? v[1] : bounds[1];
+        bounds[2] = v[0] > bounds[2] ? v[0] : bounds[2];
+        bounds[3] = v[1] > bounds[3] ? v[1] : bounds[3];
+    }
+}
+
+// Triangulation writes at most this many indices, stencil fill at most the fan indices of
+// every loop plus the cover indices, which is less.
+static unsigned max_index_count(unsigned vertex_count, unsigned num_holes)
+{
+    return 3 * (vertex_count + 2 * num_holes) + cover_index_count;
+}
+
+static void write_shape_geometry(Shape* shape, Outline* outline, int streamed)
+{
+    g_frame_dirty = 1;
+    unsigned outline_count = outline->count;
+
+    for (unsigned i = 0; i < outline->num_holes; ++i)
+        outline_count -= outline->holes[i].count;
+
+    assert(outline_count >= 3);
+    GLuint* indices = (GLuint*)malloc(max_index_count(outline->count, outline->num_holes) * sizeof(GLuint));
+    float cover[4 * 5]; // cover_vertex_count * floats_per_vertex
+    unsigned vertex_count = outline->count;
+    unsigned index_count;
+    unsigned stored_index_count;
+    compute_bounds(outline->verts, outline->count, shape->bounds);
+
+    if (shape->fill_mode == FILL_MODE_STENCIL)
+    {
+        index_count = build_stencil_fill(outline->verts, outline->count, outline_count, outline->holes, outline->num_holes, shape->bounds, cover, indices);
+        vertex_count += cover_vertex_count;
+        stored_index_count = index_count + cover_index_count;
+    }
+    else
+    {
+        index_count = triangulate(outline->verts, floats_per_vertex, outline_count, outline->holes, outline->num_holes, indices);
+        stored_index_count = index_count;
+    }
+
+    assert(vertex_count <= shape->vertex_capacity && stored_index_count <= shape->index_capacity);
+    arena_write(&g_vertex_arena, shape->first_vertex, outline->verts, outline->count, streamed);
+
+    if (shape->fill_mode == FILL_MODE_STENCIL)
+        arena_write(&g_vertex_arena, shape->first_vertex + outline->count, cover, cover_vertex_count, streamed);
+
+    arena_write(&g_index_arena, shape->first_index, indices, stored_index_count, streamed);
+    shape->lods[0].first_vertex = shape->first_vertex;
+    shape->lods[0].first_index = shape->first_index;
+    shape->lods[0].index_count = index_count;
+    shape->lods[0].tolerance = 0;
+    shape->num_lods = 1;
+    free(indices);
+}
+
+static float point_segment_distance(const float* p, const float* a, const float* b)
+{
+    float dx = b[0] - a[0];
+    float dy = b[1] - a[1];
+    float length_squared = dx * dx + dy * dy;
+    float t = length_squared > 0 ? ((p[0] - a[0]) * dx + (p[1] - a[1]) * dy) / length_squared : 0;
+    t = t < 0 ? 0 : (t > 1 ? 1 : t);
+    float ex = a[0] + t * dx - p[0];
+    float ey = a[1] + t * dy - p[1];
+    return sqrtf(ex * ex + ey * ey);
+}
+
+// Douglas-Peucker simplification of a closed loop of count vertices, writing the vertices
+// it keeps to out and returning how many. The loop is split at its first vertex and the
+// one farthest from it, then every span keeps its vertex farthest from the span's chord
+// if that is more than tolerance away, and is split there.
+static unsigned simplify_loop(const float* verts, unsigned count, float tolerance, float* out)
+{
+    unsigned char* keep = (unsigned char*)calloc(count, 1);
+    unsigned* spans = (unsigned*)malloc(count * 2 * sizeof(unsigned));
+    unsigned num_spans = 0;
+    unsigned farthest = 0;
+    float farthest_distance = -1;
+
+    for (unsigned i = 1; i < count; ++i)
+    {
+        float distance = point_segment_distance(verts + i * floats_per_vertex, verts, verts);
+
+        if (distance > farthest_distance)
+        {
+            farthest = i;
+            farthest_distance = distance;
+        }
+    }
+
+    keep[0] = keep[farthest] = 1;
+    spans[num_spans++] = 0;
+    spans[num_spans++] = farthest;
+    spans[num_spans++] = farthest;
+    spans[num_spans++] = count;
+
+    while (num_spans > 0)
+    {
+        unsigned last = spans[--num_spans];
+        unsigned first = spans[--num_spans];
+        const float* a = verts + first * floats_per_vertex;
+        const float* b = verts + (last % count) * floats_per_vertex;
+        unsigned split = 0;
+        float split_distance = tolerance;
+
+        for (unsigned i = first + 1; i < last; ++i)
+        {
+            float distance = point_segment_distance(verts + i * floats_per_vertex, a, b);
+
+            if (distance > split_distance)
+            {
+                split = i;
+                split_distance = distance;
+            }
+        }
+
+        if (split == 0)
+            continue;
+
+        keep[split] = 1;
+        spans[num_spans++] = first;
+        spans[num_spans++] = split;
+        spans[num_spans++] = split;
+        spans[num_spans++] = last;
+    }
+
+    unsigned kept = 0;
+
+    for (unsigned i = 0; i < count; ++i)
+    {
+        if (keep[i])
+            memcpy(out + kept++ * floats_per_vertex, verts + i * floats_per_vertex, floats_per_vertex * sizeof(float));
+    }
+
+    free(spans);
+    free(keep);
+    return kept;
+}
+
+// Simplifies the outline and its holes into out, which is freed with the caller's verts
+// and holes. Holes that simplify to less than a triangle are small enough to drop. Returns
+// 0 when the outline itself would, there is nothing left to draw at that tolerance.
+static int simplify_outline(const Outline* outline, float tolerance, Outline* out)
+{
+    unsigned outline_count = outline->count;
+
+    for (unsigned i = 0; i < outline->num_holes; ++i)
+        outline_count -= outline->holes[i].count;
+
+    out->verts = (float*)malloc(outline->count * floats_per_vertex * sizeof(float));
+    out->holes = (Hole*)malloc((outline->num_holes + 1) * sizeof(Hole));
+    out->num_holes = 0;
+    out->count = simplify_loop(outline->verts, outline_count, tolerance, out->verts);
+
+    if (out->count < 3)
+        return 0;
+
+    for (unsigned i = 0; i < outline->num_holes; ++i)
+    {
+        Hole* hole = out->holes + out->num_holes;
+        hole->first = out->count;
+        hole->count = simplify_loop(outline->verts + outline->holes[i].first * floats_per_vertex, outline->holes[i].count, tolerance, out->verts + out->count * floats_per_vertex);
+
+        if (hole->count < 3)
+            continue;
+
+        out->count += hole->count;
+        ++out->num_holes;
+    }
+
+    return 1;
+}
+
+// Stores coarser versions of a static, triangulated shape, each simplified by twice the
+// tolerance of the one before, starting at 1/256 of its diagonal. Tolerances that remove no
+// vertices are skipped, and simplifying stops once the outline would collapse.
+static void add_shape_lods(Shape* shape, Outline* outline)
+{
+    float width = shape->bounds[2] - shape->bounds[0];
+    float height = shape->bounds[3] - shape->bounds[1];
+    float tolerance = sqrtf(width * width + height * height) / 256;
+    unsigned previous_count = outline->count;
+
+    for (unsigned level = 1; level < MAX_LODS; ++level, tolerance *= 2)
+    {
+        Outline simplified;
+        int valid = simplify_outline(outline, tolerance, &simplified);
+
+        if (valid && simplified.count < previous_count)
+        {
+            Shape lod = *shape;
+            lod.vertex_capacity = simplified.count;
+            lod.index_capacity = max_index_count(simplified.count, simplified.num_holes);
+            GLuint old_vertex_buffer = g_vertex_arena.buffer;
+            GLuint old_index_buffer = g_index_arena.buffer;
+            lod.first_vertex = arena_alloc(&g_vertex_arena, lod.vertex_capacity);
+            lod.first_index = arena_alloc(&g_index_arena, lod.index_capacity);
+
+            if (g_vertex_arena.buffer != old_vertex_buffer || g_index_arena.buffer != old_index_buffer)
+                bind_shape_vertex_layout();
+
+            write_shape_geometry(&lod, &simplified, 0);
+            shape->lods[shape->num_lods] = lod.lods[0];
+            shape->lods[shape->num_lods++].tolerance = tolerance;
+            previous_count = simplified.count;
+        }
+
+        free(simplified.verts);
+        free(simplified.holes);
+
+        if (!valid)
+            break;
+    }
+}
+
+// Dynamic shapes reserve room for capacity vertices, or the outline's vertex count if that
+// is larger, and may then be rewritten with update_shape.
+static Handle add_shape(Outline* outline, FillMode fill_mode, int dynamic, unsigned capacity)
+{
+    Handle handle = get_free_shape_handle();
+    assert(handle != -1);
+    Shape* shape = g_shapes + handle;
+    memset(shape, 0, sizeof(Shape));
+    shape->fill_mode = fill_mode;
+    shape->dynamic = dynamic;
+    memcpy(shape->color, outline->verts + 2, sizeof(shape->color));
+    unsigned vertex_count = outline->count;
+    unsigned num_holes = outline->num_holes;
+
+    if (dynamic && capacity > vertex_count)
+        vertex_count = capacity;
+
+    // Holes need at least three vertices each, which bounds how many an update may add.
+    if (dynamic)
+        num_holes = vertex_count / 3;
+
+    GLuint old_vertex_buffer = g_vertex_arena.buffer;
+    GLuint old_index_buffer = g_index_arena.buffer;
+    shape->vertex_capacity = vertex_count + (fill_mode == FILL_MODE_STENCIL ? cover_vertex_count : 0);
+    shape->index_capacity = max_index_count(vertex_count, num_holes);
+    shape->first_vertex = arena_alloc(&g_vertex_arena, shape->vertex_capacity);
+    shape->first_index = arena_alloc(&g_index_arena, shape->index_capacity);
+
+    if (g_vertex_arena.buffer != old_vertex_buffer || g_index_arena.buffer != old_index_buffer)
+        bind_shape_vertex_layout();
+
+    write_shape_geometry(shape, outline, 0);
+
+    // Stencil filled shapes are meant to load without any preprocessing, simplifying them
+    // would cost far more than their fan ever does.
+    if (!dynamic && fill_mode != FILL_MODE_STENCIL)
+        add_shape_lods(shape, outline);
+
+    return handle;
+}
+
+// Sets the tint that all following draws are multiplied by.
+static void set_tint(float r, float g, float b, float a)
+{
+    float tint[] = { r, g, b, a };
+
+    for (unsigned i = 0; i < 4; ++i)
+    {
+        float clamped = tint[i] < 0 ? 0 : (tint[i] > 1 ? 1 : tint[i]);
+        g_tint[i] = (unsigned char)(clamped * 255 + 0.5f);
+    }
+}
+
+// Layers range from -32768 to 32767, NO_LAYER makes following draws keep their order.
+static void set_layer(int layer)
+{
+    assert(layer == NO_LAYER || (layer >= -32768 && layer <= 32767));
+    g_layer = layer;
+}
+
+// Maps the current layer to a depth, higher layers are nearer. Draws without a layer are at
+// the depth of layer 0.
+static float layer_depth()
+{
+    return g_layer == NO_LAYER ? 0.0f : -g_layer / 32768.0f;
+}
+
+static uint64_t make_sort_key(Program program, int stencil, Handle shape, unsigned lod, int blended, unsigned sequence)
+{
+    uint64_t layer = g_layer == NO_LAYER ? 32768 : (uint64_t)(g_layer + 32768);
+
+    if (g_depth_layering)
+    {
+        if (blended || g_layer == NO_LAYER)
+            return ((uint64_t)1 << 63) | (layer << 47) | sequence;
+
+        // Nearest layer first within each shape, so that early depth testing rejects what
+        // later, farther instances would draw underneath.
+        return ((uint64_t)program << 59) | ((uint64_t)stencil << 58) | ((uint64_t)shape << 42) | ((uint64_t)lod << 39) | ((65535 - layer) << 23);
+    }
+
+    uint64_t key = layer << 48;
+
+    if (blended || g_layer == NO_LAYER)
+        return key | ((uint64_t)1 << 47) | sequence;
+
+    return key | ((uint64_t)program << 43) | ((uint64_t)stencil << 42) | ((uint64_t)shape << 26) | ((uint64_t)lod << 23);
+}
+
+// Records a draw of the shape's level of detail with the given program, params may be null.
+// translucent draws have alpha even with an opaque tint, and are blended like those with a
+// translucent tint.
+static void record_draw(Program program, Handle handle, unsigned lod, float x, float y, float rotation, float scale, const float* params, int translucent)
+{
+    assert(!g_recording_commands || (program != PROGRAM_TEXT && !g_shapes[handle].dynamic));
+    g_draws = (Draw*)grow_array(g_draws, &g_draws_capacity, g_num_draws + 1, sizeof(Draw));
+    Draw* draw = g_draws + g_num_draws++;
+    g_shapes[handle].last_draw_flush = g_flush_count;
+    draw->program = program;
+    draw->shape = handle;
+    draw->lod = lod;
+    draw->blended = translucent || g_tint[3] < 255;
+    draw->instance.x = x;
+    draw->instance.y = y;
+    draw->instance.rotation = rotation;
+    draw->instance.scale = scale;
+    memcpy(draw->instance.tint, g_tint, sizeof(g_tint));
+    draw->instance.depth = layer_depth();
+
+    if (params)
+        memcpy(draw->instance.params, params, sizeof(draw->instance.params));
+    else
+        memset(draw->instance.params, 0, sizeof(draw->instance.params));
+
+    draw->sort_key = make_sort_key(program, g_shapes[handle].fill_mode == FILL_MODE_STENCIL, handle, lod, draw->blended, g_num_draws - 1);
+}
+
+// Picks the coarsest level of detail of the shape whose tolerance stays within
+// lod_pixel_tolerance on screen. The view maps world units to pixels, so a unit of the
+// shape covers scale times zoom pixels. Command lists may be replayed at any zoom, so draws
+// recorded into them keep the finest level.
+static unsigned pick_lod(const Shape* shape, float scale)
+{
+    if (g_recording_commands)
+        return 0;
+
+    float pixels_per_unit = fabsf(scale) * g_view_zoom;
+    unsigned lod = 0;
+
+    while (lod + 1 < shape->num_lods && shape->lods[lod + 1].tolerance * pixels_per_unit <= lod_pixel_tolerance)
+        ++lod;
+
+    return lod;
+}
+
+static void draw_shape(Handle handle, float x, float y, float rotation, float scale)
+{
+    assert(handle < MAX_SHAPES && !g_free_shapes[handle]);
+    record_draw(PROGRAM_SHAPE, handle, pick_lod(g_shapes + handle, scale), x, y, rotation, scale, 0, 0);
+}
+
+// The square from -1 to 1 that primitives are drawn with, made on first use.
+static Handle quad_shape()
+{
+    if (g_quad_shape != MAX_SHAPES)
+        return g_quad_shape;
+
+    float verts[] = {
+        -1, -1, 1, 1, 1,
+        1, -1, 1, 1, 1,
+        1, 1, 1, 1, 1,
+        -1, 1, 1, 1, 1
+    };
+
+    Outline outline;
+    memset(&outline, 0, sizeof(outline));
+    outline.verts = verts;
+    outline.count = 4;
+    g_quad_shape = add_shape(&outline, FILL_MODE_TRIANGULATE, 0, 0);
+    return g_quad_shape;
+}
+
+// Draws a rectangle centered on x, y with its corners rounded by radius, which is limited
+// to half of the shorter side. Circles and capsules are drawn as rounded rectangles too.
+static void draw_rounded_rect(float x, float y, float half_width, float half_height, float radius, float rotation)
+{
+    assert(half_width >= 0 && half_height >= 0 && radius >= 0);
+    float shorter = half_width < half_height ? half_width : half_height;
+    float params[] = { half_width, half_height, radius < shorter ? radius : shorter, 0 };
+    // Primitives smooth their edges with alpha, so they are always blended.
+    record_draw(PROGRAM_PRIMITIVE, quad_shape(), 0, x, y, rotation, 1, params, 1);
+}
+
+static void draw_circle(float x, float y, float radius)
+{
+    draw_rounded_rect(x, y, radius, radius, radius, 0);
+}
+
+// How far past its end point a segment end reaches, the line shader stretches its quad
+// by as much.
+static float line_end_extension(LineEnd end, float slope, float half_width)
+{
+    return end == LINE_END_FLAT ? half_width * fabsf(slope) : half_width;
+}
+
+// Finds how a segment running along direction ends where it meets the neighbouring segment
+// running along other, both unit vectors in the order the line is drawn in. at_end tells if
+// the neighbour is at the end of the segment rather than at its start.
+static void join_segment(const float* direction, const float* other, LineEnd join, int at_end, LineEnd* end, float* slope)
+{
+    float bisector_x = direction[0] + other[0];
+    float bisector_y = direction[1] + other[1];
+    float length = sqrtf(bisector_x * bisector_x + bisector_y * bisector_y);
+    *slope = 0;
+
+    // A line turning straight back has no bisector to cut along.
+    if (length < 1e-4f)
+    {
+        *end = join == LINE_END_ROUND_JOIN ? LINE_END_ROUND : LINE_END_FLAT;
+        return;
+    }
+
+    // The bisector in the segment's frame, where x runs along the segment and y to its left.
+    float along = (bisector_x * direction[0] + bisector_y * direction[1]) / length;
+    float across = (bisector_y * direction[0] - bisector_x * direction[1]) / length;
+    *slope = at_end ? -across / along : across / along;
+    *end = join;
+
+    if (join == LINE_END_FLAT && 1 + *slope * *slope > miter_limit * miter_limit)
+        *end = LINE_END_BEVEL;
+}
+
+// Returns the length of the segment from start to end and its direction, which is along x
+// when it has no length.
+static float segment_direction(const float* start, const float* end, float* direction)
+{
+    float dx = end[0] - start[0];
+    float dy = end[1] - start[1];
+    float length = sqrtf(dx * dx + dy * dy);
+    direction[0] = length > 0 ? dx / length : 1;
+    direction[1] = length > 0 ? dy / length : 0;
+    return length;
+}
+
+static void draw_segment(const float* start, const float* direction, float length, float half_width, LineEnd start_end, float start_slope, LineEnd end_end, float end_slope)
+{
+    float params[] = { half_width, start_slope, end_slope, (float)(start_end + 8 * end_end) };
+    record_draw(PROGRAM_LINE, quad_shape(), 0, start[0], start[1], atan2f(direction[1], direction[0]), length, params, 1);
+}
+
+// Draws a segment between every two of the count points, each with its own caps.
+static void draw_lines(const float* points, unsigned count, const Stroke* stroke)
+{
+    for (unsigned i = 0; i + 1 < count; i += 2)
+    {
+        float direction[2];
+        float length = segment_direction(points + i * 2, points + i * 2 + 2, direction);
+        draw_segment(points + i * 2, direction, length, stroke->half_width, stroke->cap, 0, stroke->cap, 0);
+    }
+}
+
+// Draws the line through the count points, one segment instance each. Consecutive
+// duplicates of a point are dropped from points, as they have no direction to join along.
+static void draw_polyline(float* points, unsigned count, const Stroke* stroke, int closed)
+{
+    unsigned n = 0;
+
+    for (unsigned i = 0; i < count; ++i)
+    {
+        if (n > 0 && points[i * 2] == points[n * 2 - 2] && points[i * 2 + 1] == points[n * 2 - 1])
+            continue;
+
+        points[n * 2] = points[i * 2];
+        points[n * 2 + 1] = points[i * 2 + 1];
+        ++n;
+    }
+
+    if (closed && n > 1 && points[0] == points[n * 2 - 2] && points[1] == points[n * 2 - 1])
+        --n;
+
+    if (n < 2)
+        return;
+
+    unsigned num_segments = closed ? n : n - 1;
+
+    for (unsigned i = 0; i < num_segments; ++i)
+    {
+        const float* start = points + i * 2;
+        float direction[2];
+        float other[2];
+        float length = segment_direction(start, points + (i + 1) % n * 2, direction);
+        LineEnd start_end = stroke->cap;
+        LineEnd end_end = stroke->cap;
+        float start_slope = 0;
+        float end_slope = 0;
+
+        if (closed || i > 0)
+        {
+            unsigned previous = (i + n - 1) % n;
+            segment_direction(points + previous * 2, start, other);
+            join_segment(direction, other, stroke->join, 0, &start_end, &start_slope);
+        }
+
+        if (closed || i + 1 < num_segments)
+        {
+            unsigned next = (i + 1) % n;
+            segment_direction(points + next * 2, points + (next + 1) % n * 2, other);
+            join_segment(direction, other, stroke->join, 1, &end_end, &end_slope);
+        }
+
+        draw_segment(start, direction, length, stroke->half_width, start_end, start_slope, end_end, end_slope);
+    }
+}
+
+// Makes the atlas texture num_pages pages deep, keeping the pages it already had.
+static void resize_atlas(unsigned num_pages)
+{
+    GLuint texture;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA8, g_atlas.size, g_atlas.size, num_pages, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+
+    if (g_atlas.texture && glCopyImageSubData)
+    {
+        glCopyImageSubData(g_atlas.texture, GL_TEXTURE_2D_ARRAY, 0, 0, 0, 0, texture, GL_TEXTURE_2D_ARRAY, 0, 0, 0, 0, g_atlas.size, g_atlas.size, g_atlas.num_pages);
+    }
+    else if (g_atlas.texture)
+    {
+        // Without image copies the old pages are read back through a framebuffer.
+        GLuint framebuffer;
+        glGenFramebuffers(1, &framebuffer);
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+
+        for (unsigned i = 0; i < g_atlas.num_pages; ++i)
+        {
+            glFramebufferTextureLayer(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, g_atlas.texture, 0, i);
+            glCopyTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, i, 0, 0, g_atlas.size, g_atlas.size);
+        }
+
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+        glDeleteFramebuffers(1, &framebuffer);
+    }
+
+    if (g_atlas.texture)
+        glDeleteTextures(1, &g_atlas.texture);
+
+    g_atlas.texture = texture;
+}
+
+// Checks if a width by height rectangle fits with its left edge at the start of segment
+// index, and at which y. It rests on the highest segment it spans.
+static int skyline_fit(const AtlasPage* page, unsigned index, unsigned width, unsigned height, unsigned* y)
+{
+    unsigned x = page->skyline[index].x;
+    unsigned remaining = width;
+    *y = 0;
+
+    if (x + width > g_atlas.size)
+        return 0;
+
+    for (unsigned i = index; remaining > 0; ++i)
+    {
+        if (page->skyline[i].y > *y)
+            *y = page->skyline[i].y;
+
+        if (*y + height > g_atlas.size)
+            return 0;
+
+        remaining -= remaining < page->skyline[i].width ? remaining : page->skyline[i].width;
+    }
+
+    return 1;
+}
+
+// Places a width by height rectangle as low as possible on the page's skyline, and then as
+// far left. Returns 0 if it does not fit.
+static int skyline_pack(AtlasPage* page, unsigned width, unsigned height, unsigned* x, unsigned* y)
+{
+    int best = -1;
+    unsigned best_y = 0;
+
+    for (unsigned i = 0; i < page->num_segments; ++i)
+    {
+        unsigned fit_y;
+
+        if (skyline_fit(page, i, width, height, &fit_y) && (best == -1 || fit_y < best_y))
+        {
+            best = i;
+            best_y = fit_y;
+        }
+    }
+
+    if (best == -1)
+        return 0;
+
+    *x = page->skyline[best].x;
+    *y = best_y;
+
+    // The rectangle's top becomes a new segment, which shortens or removes the segments
+    // it covers.
+    page->skyline = (SkylineSegment*)grow_array(page->skyline, &page->capacity, page->num_segments + 1, sizeof(SkylineSegment));
+    memmove(page->skyline + best + 1, page->skyline + best, (page->num_segments - best) * sizeof(SkylineSegment));
+    ++page->num_segments;
+    page->skyline[best].x = *x;
+    page->skyline[best].y = best_y + height;
+    page->skyline[best].width = width;
+    unsigned end = *x + width;
+    unsigned next = best + 1;
+
+    while (next < page->num_segments && page->skyline[next].x < end)
+    {
+        SkylineSegment* segment = page->skyline + next;
+        unsigned covered = end - segment->x;
+
+        if (covered < segment->width)
+        {
+            segment->x += covered;
+            segment->width -= covered;
+            break;
+        }
+
+        memmove(segment, segment + 1, (page->num_segments - next - 1) * sizeof(SkylineSegment));
+        --page->num_segments;
+    }
+
+    for (unsigned i = 1; i < page->num_segments; ++i)
+    {
+        if (page->skyline[i - 1].y != page->skyline[i].y)
+            continue;
+
+        page->skyline[i - 1].width += page->skyline[i].width;
+        memmove(page->skyline + i, page->skyline + i + 1, (page->num_segments - i - 1) * sizeof(SkylineSegment));
+        --page->num_segments;
+        --i;
+    }
+
+    return 1;
+}
+
+// Packs the width by height RGBA image into the atlas, adding a page if none has room left,
+// and returns its handle. Images are kept a pixel apart so that sprites never pick up
+// their neighbours.
+static Handle add_image(unsigned width, unsigned height, const unsigned char* pixels)
+{
+    if (g_atlas.size == 0)
+    {
+        GLint max_size;
+        glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+        g_atlas.size = max_size < 2048 ? max_size : 2048;
+    }
+
+    assert(width > 0 && height > 0 && width < g_atlas.size && height < g_atlas.size);
+    Image image;
+    image.width = width;
+    image.height = height;
+    image.page = 0;
+
+    while (image.page < g_atlas.num_pages && !skyline_pack(g_atlas.pages + image.page, width + 1, height + 1, &image.x, &image.y))
+        ++image.page;
+
+    if (image.page == g_atlas.num_pages)
+    {
+        assert(g_atlas.num_pages < MAX_ATLAS_PAGES);
+        resize_atlas(g_atlas.num_pages + 1);
+        AtlasPage* page = g_atlas.pages + g_atlas.num_pages++;
+        memset(page, 0, sizeof(AtlasPage));
+        page->skyline = (SkylineSegment*)grow_array(0, &page->capacity, 1, sizeof(SkylineSegment));
+        page->skyline[0].x = 0;
+        page->skyline[0].y = 0;
+        page->skyline[0].width = g_atlas.size;
+        page->num_segments = 1;
+        int packed = skyline_pack(page, width + 1, height + 1, &image.x, &image.y);
+        assert(packed);
+    }
+
+    image.translucent = 0;
+
+    for (unsigned i = 0; i < width * height && !image.translucent; ++i)
+        image.translucent = pixels[i * 4 + 3] < 255;
+
+    glBindTexture(GL_TEXTURE_2D_ARRAY, g_atlas.texture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, image.x, image.y, image.page, width, height, 1, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+    g_images = (Image*)grow_array(g_images, &g_images_capacity, g_num_images + 1, sizeof(Image));
+    g_images[g_num_images] = image;
+    return g_num_images++;
+}
+
+// Draws the image centered on x, y, at its size in pixels times scale.
+static void draw_sprite(Handle handle, float x, float y, float rotation, float scale)
+{
+    assert(handle < g_num_images);
+    const Image* image = g_images + handle;
+    float params[] = { (float)image->x, (float)(image->page * g_atlas.size + image->y), (float)image->width, (float)image->height };
+    record_draw(PROGRAM_SPRITE, quad_shape(), 0, x, y, rotation, scale, params, image->translucent);
+}
+
+// Draws the segment from x1, y1 to x2, y2 with round ends and a thickness of twice radius.
+static void draw_capsule(float x1, float y1, float x2, float y2, float radius)
+{
+    float dx = x2 - x1;
+    float dy = y2 - y1;
+    float half_length = sqrtf(dx * dx + dy * dy) * 0.5f;
+    draw_rounded_rect((x1 + x2) * 0.5f, (y1 + y2) * 0.5f, half_length + radius, radius, radius, atan2f(dy, dx));
+}
+
+static void draw_command(const DrawElementsIndirectCommand* command)
+{
+    const void* first_index = (void*)(command->first_index * sizeof(GLuint));
+
+    if (glDrawElementsInstancedBaseVertexBaseInstance)
+    {
+        glDrawElementsInstancedBaseVertexBaseInstance(GL_TRIANGLES, command->count, GL_UNSIGNED_INT, first_index, command->instance_count, command->base_vertex, command->base_instance);
+        return;
+    }
+
+    // Without base instance support the instance attribute is offset by hand instead.
+    bind_instances(g_instance_buffer, g_instance_offset + command->base_instance * sizeof(Instance));
+    glDrawElementsInstancedBaseVertex(GL_TRIANGLES, command->count, GL_UNSIGNED_INT, first_index, command->instance_count, command->base_vertex);
+    bind_instances(g_instance_buffer, g_instance_offset);
+}
+
+// Draws commands first to first + count, which are also in the bound indirect buffer at
+// g_command_offset when multi draws are supported.
+static void draw_commands(const DrawElementsIndirectCommand* commands, unsigned first, unsigned count)
+{
+    if (count == 0)
+        return;
+
+    if (glMultiDrawElementsIndirect)
+    {
+        glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (void*)(g_command_offset + first * sizeof(DrawElementsIndirectCommand)), count, 0);
+        return;
+    }
+
+    for (unsigned i = first; i < first + count; ++i)
+        draw_command(commands + i);
+}
+
+static void draw_stencil_shape(const DrawElementsIndirectCommand* command)
+{
+    // Flip the lowest stencil bit for every fan triangle, then cover the bounding
+    // rectangle where the bit ended up set. Covering also zeroes the bit again, so the
+    // stencil buffer is clean for the next stencil filled shape.
+    DrawElementsIndirectCommand cover = *command;
+    cover.first_index += command->count;
+    cover.count = cover_index_count;
+    set_capability(GL_STENCIL_TEST, 1);
+    glStencilMask(0x01);
+    glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+    glDepthMask(GL_FALSE);
+    glStencilFunc(GL_ALWAYS, 0, 0x01);
+    glStencilOp(GL_KEEP, GL_KEEP, GL_INVERT);
+    draw_command(command);
+    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    glDepthMask(GL_TRUE);
+    glStencilFunc(GL_NOTEQUAL, 0, 0x01);
+    glStencilOp(GL_ZERO, GL_ZERO, GL_ZERO);
+    draw_command(&cover);
+    set_capability(GL_STENCIL_TEST, 0);
+}
+
+// The size of a screen pixel in world units. A view zoomed to nothing is treated as zoomed
+// out very far rather than dividing by zero.
+static float view_pixel_size()
+{
+    return 1.0f / fmaxf(fabsf(g_view_zoom), 1e-6f);
+}
+
+// The view zooms and rotates around the center of the window. With no zoom or rotation
+// it is a plain translation by the view position.
+static void recalculate_view_matrix()
+{
+    float c = cosf(g_view_rotation) * g_view_zoom;
+    float s = sinf(g_view_rotation) * g_view_zoom;
+    float center_x = g_window_width * 0.5f;
+    float center_y = g_window_height * 0.5f;
+    float pivot_x = g_view_position[0] + center_x;
+    float pivot_y = g_view_position[1] + center_y;
+    mat_ident(g_view_matrix);
+    g_view_matrix[0] = c;
+    g_view_matrix[1] = -s;
+    g_view_matrix[4] = s;
+    g_view_matrix[5] = c;
+    g_view_matrix[12] = center_x - (c * pivot_x + s * pivot_y);
+    g_view_matrix[13] = center_y - (-s * pivot_x + c * pivot_y);
+}
+
+// Maps count points from window pixels to world units in place, by the inverse of the view.
+static void screen_to_world(float* points, unsigned count)
+{
+    recalculate_view_matrix();
+    const float* view = g_view_matrix;
+    float determinant = view[0] * view[5] - view[4] * view[1];
+    float inverse[16];
+    mat_ident(inverse);
+    inverse[0] = view[5] / determinant;
+    inverse[1] = -view[1] / determinant;
+    inverse[4] = -view[4] / determinant;
+    inverse[5] = view[0] / determinant;
+    inverse[12] = -(view[12] * inverse[0] + view[13] * inverse[4]);
+    inverse[13] = -(view[12] * inverse[1] + view[13] * inverse[5]);
+    transform_points(inverse, points, points, count);
+}
+
+// Recalculates the view projection if the camera was changed since it was last used.
+static void update_camera()
+{
+    if (!g_camera_dirty)
+        return;
+
+    recalculate_view_matrix();
+    mat_mul(g_view_matrix, g_projection_matrix, g_view_projection_matrix);
+    g_camera_dirty = 0;
+}
+
+// Writes the camera block to data, allocated from the stream ring at offset, and binds it.
+// The block holds the view projection followed by the size of a pixel in world units, which
+// primitives and lines grow their quads by. Ring allocations start on 256 byte boundaries,
+// which is as strict as uniform buffer offsets get.
+static void write_camera(void* data, size_t offset, const float* view_projection)
+{
+    float* camera = (float*)data;
+    memcpy(camera, view_projection, sizeof(float) * 16);
+    camera[16] = view_pixel_size();
+    camera[17] = camera[18] = camera[19] = 0;
+
+    // Binding a buffer to an indexed uniform binding also binds it to the generic one, so
+    // the cached binding is made to match first.
+    bind_buffer(GL_UNIFORM_BUFFER, g_stream.buffer);
+    glBindBufferRange(GL_UNIFORM_BUFFER, camera_binding, g_stream.buffer, offset, camera_size);
+}
+
+// Stable least significant digit radix sort on 8 bit digits. Digits that are equal for all
+// keys are skipped, which is most of them since a frame only uses a few layers and shapes.
+// Returns whichever of the two arrays ends up holding the sorted items.
+static SortItem* radix_sort(SortItem* items, SortItem* scratch, unsigned count)
+{
+    static unsigned histograms[8][256];
+    memset(histograms, 0, sizeof(histograms));
+
+    for (unsigned i = 0; i < count; ++i)
+    {
+        uint64_t key = items[i].key;
+
+        for (unsigned digit = 0; digit < 8; ++digit)
+            ++histograms[digit][(key >> (digit * 8)) & 0xff];
+    }
+
+    for (unsigned digit = 0; digit < 8; ++digit)
+    {
+        unsigned* histogram = histograms[digit];
+        unsigned shift = digit * 8;
+
+        if (histogram[(items[0].key >> shift) & 0xff] == count)
+            continue;
+
+        unsigned offset = 0;
+
+        for (unsigned bucket = 0; bucket < 256; ++bucket)
+        {
+            unsigned bucket_count = histogram[bucket];
+            histogram[bucket] = offset;
+            offset += bucket_count;
+        }
+
+        for (unsigned i = 0; i < count; ++i)
+            scratch[histogram[(items[i].key >> shift) & 0xff]++] = items[i];
+
+        SortItem* sorted = scratch;
+        scratch = items;
+        items = sorted;
+    }
+
+    return items;
+}
+
+static void sort_draws()
+{
+    int sorted = 1;
+
+    for (unsigned i = 1; i < g_num_draws && sorted; ++i)
+        sorted = g_draws[i - 1].sort_key <= g_draws[i].sort_key;
+
+    if (sorted)
+        return;
+
+    unsigned capacity = g_sort_capacity;
+    g_sort_items = (SortItem*)grow_array(g_sort_items, &g_sort_capacity, g_num_draws, sizeof(SortItem));
+    g_sort_scratch = (SortItem*)grow_array(g_sort_scratch, &capacity, g_num_draws, sizeof(SortItem));
+    g_sorted_draws = (Draw*)grow_array(g_sorted_draws, &g_sorted_draws_capacity, g_num_draws, sizeof(Draw));
+
+    for (unsigned i = 0; i < g_num_draws; ++i)
+    {
+        g_sort_items[i].key = g_draws[i].sort_key;
+        g_sort_items[i].index = i;
+    }
+
+    SortItem* items = radix_sort(g_sort_items, g_sort_scratch, g_num_draws);
+
+    for (unsigned i = 0; i < g_num_draws; ++i)
+        g_sorted_draws[i] = g_draws[items[i].index];
+
+    Draw* draws = g_draws;
+    unsigned draws_capacity = g_draws_capacity;
+    g_draws = g_sorted_draws;
+    g_draws_capacity = g_sorted_draws_capacity;
+    g_sorted_draws = draws;
+    g_sorted_draws_capacity = draws_capacity;
+}
+
+// Finds the world space box around what the draw covers. Every instance has its own
+// transform, so this is done draw by draw.
+static void draw_world_bounds(const Draw* draw, float* draw_bounds)
+{
+    const Instance* instance = &draw->instance;
+    const float* bounds = g_shapes[draw->shape].bounds;
+    float c = cosf(instance->rotation);
+    float s = sinf(instance->rotation);
+    float signed_scale = instance->scale;
+    float center_x = (bounds[0] + bounds[2]) * 0.5f;
+    float center_y = (bounds[1] + bounds[3]) * 0.5f;
+    float extent_x = (bounds[2] - bounds[0]) * 0.5f;
+    float extent_y = (bounds[3] - bounds[1]) * 0.5f;
+
+    // Primitives stretch the unit quad by the half extents in their params, sprites and
+    // glyphs by half their size in the atlas. Lines use scale as their length, their
+    // bounds cover the longest their ends may get.
+    if (draw->program == PROGRAM_PRIMITIVE)
+    {
+        center_x *= instance->params[0];
+        center_y *= instance->params[1];
+        extent_x *= instance->params[0];
+        extent_y *= instance->params[1];
+    }
+    else if (draw->program == PROGRAM_SPRITE || draw->program == PROGRAM_TEXT)
+    {
+        extent_x *= instance->params[2] * 0.5f;
+        extent_y *= instance->params[3] * 0.5f;
+    }
+    else if (draw->program == PROGRAM_LINE)
+    {
+        float half_width = instance->params[0];
+        int ends = (int)instance->params[3];
+        float start = -line_end_extension((LineEnd)(ends % 8), instance->params[1], half_width);
+        float end = instance->scale + line_end_extension((LineEnd)(ends / 8), instance->params[2], half_width);
+        center_x = (start + end) * 0.5f;
+        center_y = 0;
+        extent_x = (end - start) * 0.5f;
+        extent_y = half_width;
+        signed_scale = 1;
+    }
+
+    // Primitives and lines are drawn a pixel larger than they are to fit their smoothed edges.
+    float padding = draw->program == PROGRAM_PRIMITIVE || draw->program == PROGRAM_LINE ? view_pixel_size() : 0;
+    float scale = fabsf(signed_scale);
+    float rotated_center_x = (c * center_x - s * center_y) * signed_scale;
+    float rotated_center_y = (s * center_x + c * center_y) * signed_scale;
+    float rotated_extent_x = (fabsf(c) * extent_x + fabsf(s) * extent_y) * scale;
+    float rotated_extent_y = (fabsf(s) * extent_x + fabsf(c) * extent_y) * scale;
+    draw_bounds[0] = instance->x + rotated_center_x - rotated_extent_x - padding;
+    draw_bounds[1] = instance->y + rotated_center_y - rotated_extent_y - padding;
+    draw_bounds[2] = instance->x + rotated_center_x + rotated_extent_x + padding;
+    draw_bounds[3] = instance->y + rotated_center_y + rotated_extent_y + padding;
+}
+
+// Drops the draws whose bounds end up entirely outside of clip space.
+static void cull_draws()
+{
+    g_draw_bounds = (float*)grow_array(g_draw_bounds, &g_draw_bounds_capacity, g_num_draws * 4, sizeof(float));
+
+    // The view projection is applied to all of the world bounds at once.
+    for (unsigned i = 0; i < g_num_draws; ++i)
+        draw_world_bounds(g_draws + i, g_draw_bounds + i * 4);
+
+    transform_aabbs(g_view_projection_matrix, g_draw_bounds, g_draw_bounds, g_num_draws);
+    unsigned num_visible = 0;
+
+    for (unsigned i = 0; i < g_num_draws; ++i)
+    {
+        const float* clip_bounds = g_draw_bounds + i * 4;
+
+        if (clip_bounds[0] > 1 || clip_bounds[1] > 1 || clip_bounds[2] < -1 || clip_bounds[3] < -1)
+            continue;
+
+        g_draws[num_visible++] = g_draws[i];
+    }
+
+    g_num_draws = num_visible;
+}
+
+// Turns the sorted draws into commands. Consecutive draws of the same shape become one
+// instanced command, whose base instance is the index of its first draw. Returns how many
+// commands there are.
+static unsigned build_commands()
+{
+    g_commands = (DrawElementsIndirectCommand*)grow_array(g_commands, &g_commands_capacity, g_num_draws, sizeof(DrawElementsIndirectCommand));
+    unsigned num_commands = 0;
+
+    for (unsigned i = 0; i < g_num_draws; ++i)
+    {
+        const Draw* draw = g_draws + i;
+        const Shape* shape = g_shapes + draw->shape;
+
+        // Instances of a stencil filled shape would flip each other's stencil bits where
+        // they overlap, so those are never merged. Merged draws also have to agree on
+        // program and blending, which are switched between commands.
+        if (i > 0 && draw->shape == g_draws[i - 1].shape && draw->lod == g_draws[i - 1].lod && draw->program == g_draws[i - 1].program && shape->fill_mode != FILL_MODE_STENCIL && draw->blended == g_draws[i - 1].blended)
+        {
+            ++g_commands[num_commands - 1].instance_count;
+            continue;
+        }
+
+        DrawElementsIndirectCommand* command = g_commands + num_commands++;
+        const ShapeLod* lod = shape->lods + draw->lod;
+        command->count = lod->index_count;
+        command->instance_count = 1;
+        command->first_index = lod->first_index;
+        command->base_vertex = lod->first_vertex;
+        command->base_instance = i;
+    }
+
+    return num_commands;
+}
+
+// Draws the commands of draws, whose instances are at g_instance_offset in
+// g_instance_buffer. Commands are submitted in sorted order, only split into several multi
+// draws where the program or blending changes or a stencil filled shape needs its own
+// passes. Blended draws keep their relative order, everything in between them is still one
+// call.
+static void submit_commands(const Draw* draws, const DrawElementsIndirectCommand* commands, unsigned num_commands)
+{
+    bind_vertex_array(g_shape_vertex_array);
+    bind_instances(g_instance_buffer, g_instance_offset);
+    unsigned batch_start = 0;
+    int blending = -1;
+    int program = -1;
+
+    for (unsigned i = 0; i < num_commands; ++i)
+    {
+        const Draw* draw = draws + commands[i].base_instance;
+
+        if (draw->blended != blending || (int)draw->program != program)
+        {
+            draw_commands(commands, batch_start, i - batch_start);
+            batch_start = i;
+            blending = draw->blended;
+            program = draw->program;
+            set_capability(GL_BLEND, blending);
+            use_program(g_programs[program]);
+        }
+
+        if (g_shapes[draw->shape].fill_mode != FILL_MODE_STENCIL)
+            continue;
+
+        draw_commands(commands, batch_start, i - batch_start);
+        draw_stencil_shape(commands + i);
+        batch_start = i + 1;
+    }
+
+    draw_commands(commands, batch_start, num_commands - batch_start);
+}
+
+// Puts a timestamp before the GPU work of the pass. Passes that don't fit in the frame's
+// queries go untimed.
+static void begin_gpu_pass(GpuPass pass)
+{
+    GpuTimerFrame* frame = g_gpu_timers + g_gpu_timer_frame % GPU_TIMER_FRAMES;
+
+    if (!glQueryCounter || frame->num_timestamps + 2 > MAX_GPU_TIMESTAMPS)
+        return;
+
+    frame->passes[frame->num_timestamps / 2] = pass;
+    glQueryCounter(frame->queries[frame->num_timestamps++], GL_TIMESTAMP);
+}
+
+static void end_gpu_pass()
+{
+    GpuTimerFrame* frame = g_gpu_timers + g_gpu_timer_frame % GPU_TIMER_FRAMES;
+
+    if (frame->num_timestamps % 2 == 1)
+        glQueryCounter(frame->queries[frame->num_timestamps++], GL_TIMESTAMP);
+}
+
+// Moves on to the oldest frame's queries, reading its times first if the GPU is done with
+// them. Queries finish in order, so the last one being available means all of them are.
+// Reading is never waited for, the times are just not updated if the GPU is that far behind.
+static void end_gpu_frame()
+{
+    if (!glQueryCounter)
+        return;
+
+    GpuTimerFrame* frame = g_gpu_timers + ++g_gpu_timer_frame % GPU_TIMER_FRAMES;
+    GLint available = 0;
+
+    if (frame->num_timestamps > 0)
+        glGetQueryObjectiv(frame->queries[frame->num_timestamps - 1], GL_QUERY_RESULT_AVAILABLE, &available);
+
+    if (available)
+    {
+        GLuint64 timestamps[MAX_GPU_TIMESTAMPS];
+
+        for (unsigned i = 0; i < frame->num_timestamps; ++i)
+            glGetQueryObjectui64v(frame->queries[i], GL_QUERY_RESULT, timestamps + i);
+
+        memset(g_gpu_times, 0, sizeof(g_gpu_times));
+
+        for (unsigned i = 0; i < frame->num_timestamps; i += 2)
+            g_gpu_times[frame->passes[i / 2]] += (timestamps[i + 1] - timestamps[i]) * 1e-9;
+
+        g_gpu_times[NUM_GPU_PASSES] = (timestamps[frame->num_timestamps - 1] - timestamps[0]) * 1e-9;
+        g_gpu_times_known = 1;
+    }
+
+    frame->num_timestamps = 0;
+}
+
+// Does the clear that was asked for last, if it wasn't done yet. Clears wait for the first
+// thing drawn after them, so that a frame that turns out to be unchanged isn't drawn at all.
+static void submit_clear()
+{
+    g_frame_submitted = 1;
+
+    if (!g_clear_pending)
+        return;
+
+    g_clear_pending = 0;
+    GLbitfield mask = GL_COLOR_BUFFER_BIT | GL_STENCIL_BUFFER_BIT;
+    glClearColor(g_clear_color[0], g_clear_color[1], g_clear_color[2], 1.0f);
+    glClearStencil(0);
+
+    if (g_clear_depth)
+    {
+        glClearDepth(1.0);
+        mask |= GL_DEPTH_BUFFER_BIT;
+    }
+
+    begin_gpu_pass(GPU_PASS_CLEAR);
+    glClear(mask);
+    end_gpu_pass();
+}
+
+// Submits everything drawn since the last flush. Runs of triangulated shapes go out in a
+// single multi draw, so the number of API calls no longer depends on how many shapes or
+// positions a frame uses. Stencil filled shapes need their own state and are drawn one by
+// one, in order.
+static void flush_draws()
+{
+    // Draws made while recording a command list wait for end_recording instead.
+    if (g_num_draws == 0 || g_recording_commands)
+        return;
+
+    double start = clock_seconds();
+    ++g_flush_count;
+    update_camera();
+    cull_draws();
+
+    if (g_num_draws == 0)
+    {
+        add_frame_timing(FRAME_TIMING_SUBMISSION, start);
+        return;
+    }
+
+    sort_draws();
+    unsigned num_commands = build_commands();
+
+    // The camera, instances and commands share one allocation, since running out of room
+    // replaces the ring and with it anything already allocated this frame.
+    unsigned instances_size = g_num_draws * sizeof(Instance);
+    unsigned commands_size = glMultiDrawElementsIndirect ? num_commands * sizeof(DrawElementsIndirectCommand) : 0;
+    size_t camera_offset;
+    char* camera = (char*)stream_alloc(&g_stream, camera_size + instances_size + commands_size, &camera_offset);
+    char* data = camera + camera_size;
+    Instance* instances = (Instance*)data;
+    write_camera(camera, camera_offset, g_view_projection_matrix);
+    g_instance_buffer = g_stream.buffer;
+    g_instance_offset = camera_offset + camera_size;
+
+    for (unsigned i = 0; i < g_num_draws; ++i)
+        instances[i] = g_draws[i].instance;
+
+    if (commands_size)
+    {
+        memcpy(data + instances_size, g_commands, commands_size);
+        g_command_offset = g_instance_offset + instances_size;
+        bind_buffer(GL_DRAW_INDIRECT_BUFFER, g_stream.buffer);
+    }
+
+    stream_commit(&g_stream);
+    submit_clear();
+    begin_gpu_pass(GPU_PASS_DRAWS);
+    submit_commands(g_draws, g_commands, num_commands);
+    end_gpu_pass();
+    g_num_draws = 0;
+    add_frame_timing(FRAME_TIMING_SUBMISSION, start);
+}
+
+static void clear(float r, float g, float b)
+{
+    assert(!g_recording_commands);
+    flush_draws();
+    g_clear_color[0] = r;
+    g_clear_color[1] = g;
+    g_clear_color[2] = b;
+    g_clear_depth = g_depth_layering;
+    g_clear_pending = 1;
+}
+
+// Everything that decides what a frame that was never submitted before flip looks like.
+// Draws have no padding, so they are hashed as they are.
+static uint64_t frame_hash()
+{
+    float view[] = { g_view_position[0], g_view_position[1], g_view_zoom, g_view_rotation, g_clear_color[0], g_clear_color[1], g_clear_color[2] };
+    int state[] = { (int)g_window_width, (int)g_window_height, g_depth_layering, g_clear_pending, g_clear_depth };
+    uint64_t hash = hash_bytes(0xcbf29ce484222325ull, view, sizeof(view));
+    hash = hash_bytes(hash, state, sizeof(state));
+    return hash_bytes(hash, g_draws, g_num_draws * sizeof(Draw));
+}
+
+// Presents the frame, returns 0 if it was skipped instead. With skip_unchanged_frames a
+// frame that is the same as the last one presented is neither drawn nor presented, and
+// the wait for the next refresh that presenting would have made is spent waiting for input.
+// Frames that had to submit before flip, for a changed view or a layer cache, are always
+// presented.
+static int flip()
+{
+    assert(g_open_layer_cache == NO_LAYER_CACHE && !g_recording_commands);
+    int comparable = g_skip_unchanged_frames && !g_frame_submitted;
+    uint64_t hash = comparable ? frame_hash() : 0;
+
+    if (comparable && g_presented_frame_known && !g_frame_dirty && hash == g_presented_frame_hash)
+    {
+        g_num_draws = 0;
+        g_clear_pending = 0;
+        wait_for_message(g_refresh_interval);
+        end_frame_timing();
+        return 0;
+    }
+
+    flush_draws();
+    submit_clear();
+    double start = clock_seconds();
+    SwapBuffers(g_device_context);
+    stream_end_frame(&g_stream);
+    end_gpu_frame();
+    limit_frame_rate();
+    add_frame_timing(FRAME_TIMING_PRESENT, start);
+    end_frame_timing();
+    g_presented_frame_known = comparable;
+    g_presented_frame_hash = hash;
+    g_frame_submitted = 0;
+    g_frame_dirty = 0;
+    return 1;
+}
+
+static void set_skip_unchanged_frames(int enabled)
+{
+    g_skip_unchanged_frames = enabled;
+    g_presented_frame_known = 0;
+}
+
+static void update_shape(Handle handle, Outline* outline)
+{
+    assert(handle < MAX_SHAPES && !g_free_shapes[handle]);
+    Shape* shape = g_shapes + handle;
+    assert(shape->dynamic);
+
+    // Draws recorded before the update have to show the old geometry.
+    if (shape->last_draw_flush == g_flush_count)
+        flush_draws();
+
+    write_shape_geometry(shape, outline, 1);
+}
+
+static void move_view(float x, float y)
+{
+    // Draws already recorded were made with the old view.
+    flush_draws();
+    g_view_position[0] += x;
+    g_view_position[1] += y;
+    g_camera_dirty = 1;
+}
+
+static void set_view_zoom(float zoom)
+{
+    flush_draws();
+    g_view_zoom = zoom;
+    g_camera_dirty = 1;
+}
+
+static void set_view_rotation(float rotation)
+{
+    flush_draws();
+    g_view_rotation = rotation;
+    g_camera_dirty = 1;
+}
+
+// Makes layers use the depth buffer rather than the submission order. Opaque draws with a
+// layer can then be batched across layers, and blended draws are still drawn in order on top
+// of them. The depth buffer is cleared by clear() while this is enabled.
+static void set_depth_layering(int enabled)
+{
+    flush_draws();
+    g_depth_layering = enabled;
+    set_capability(GL_DEPTH_TEST, enabled);
+}
+
+// Layer caches keep their content as long as the view stays within guard pixels of where
+// it was when they were rendered.
+static Handle add_layer_cache(unsigned guard)
+{
+    assert(g_num_layer_caches < MAX_LAYER_CACHES);
+    LayerCache* cache = g_layer_caches + g_num_layer_caches;
+    memset(cache, 0, sizeof(LayerCache));
+    cache->guard = guard;
+    glGenFramebuffers(1, &cache->framebuffer);
+    glGenTextures(1, &cache->texture);
+    glGenRenderbuffers(1, &cache->depth_stencil);
+    return g_num_layer_caches++;
+}
+
+static void invalidate_layer_cache(Handle handle)
+{
+    assert(handle < g_num_layer_caches);
+    g_layer_caches[handle].valid = 0;
+}
+
+// Starts the draws that make up the layer cache. Returns 1 if they have to be made, in which
+// case they are rendered into the cache until end_layer_cache. Otherwise the cache still
+// holds them and they can be skipped.
+static int begin_layer_cache(Handle handle)
+{
+    assert(handle < g_num_layer_caches && g_open_layer_cache == NO_LAYER_CACHE && !g_recording_commands);
+    LayerCache* cache = g_layer_caches + handle;
+    unsigned width = g_window_width + 2 * cache->guard;
+    unsigned height = g_window_height + 2 * cache->guard;
+    g_open_layer_cache = handle;
+    flush_draws();
+    submit_clear();
+    recalculate_view_matrix();
+    float shift_x = g_view_matrix[12] - cache->translation[0];
+    float shift_y = g_view_matrix[13] - cache->translation[1];
+
+    if (cache->valid && cache->width == width && cache->height == height && cache->zoom == g_view_zoom && cache->rotation == g_view_rotation
+        && fabsf(shift_x) <= cache->guard && fabsf(shift_y) <= cache->guard)
+    {
+        return 0;
+    }
+
+    if (cache->width != width || cache->height != height)
+    {
+        cache->width = width;
+        cache->height = height;
+        glActiveTexture(GL_TEXTURE2);
+        glBindTexture(GL_TEXTURE_2D, cache->texture);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+        glActiveTexture(GL_TEXTURE0);
+        glBindRenderbuffer(GL_RENDERBUFFER, cache->depth_stencil);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
+        glBindFramebuffer(GL_FRAMEBUFFER, cache->framebuffer);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, cache->texture, 0);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, cache->depth_stencil);
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, cache->framebuffer);
+    glViewport(0, 0, width, height);
+    glClearColor(0, 0, 0, 0);
+    glClearDepth(1.0);
+    glClearStencil(0);
+    begin_gpu_pass(GPU_PASS_LAYER_CACHES);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+    end_gpu_pass();
+    recalculate_projection_matrix(cache->guard);
+    g_camera_dirty = 1;
+    cache->valid = 1;
+    cache->zoom = g_view_zoom;
+    cache->rotation = g_view_rotation;
+    cache->translation[0] = g_view_matrix[12];
+    cache->translation[1] = g_view_matrix[13];
+    g_recording_layer_cache = handle;
+    return 1;
+}
+
+// Finishes rendering the layer cache if it was, then composites it onto the window, shifted
+// by how far the view has moved since it was rendered.
+static void end_layer_cache(Handle handle)
+{
+    assert(handle == g_open_layer_cache);
+    LayerCache* cache = g_layer_caches + handle;
+    flush_draws();
+    g_open_layer_cache = NO_LAYER_CACHE;
+
+    if (g_recording_layer_cache == handle)
+    {
+        g_recording_layer_cache = NO_LAYER_CACHE;
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glViewport(0, 0, g_window_width, g_window_height);
+        recalculate_projection_matrix(0);
+        g_camera_dirty = 1;
+    }
+
+    // The view matrix's translation is in units of the projection, which spans the window
+    // less one pixel.
+    recalculate_view_matrix();
+    float shift_x = (g_view_matrix[12] - cache->translation[0]) * g_window_width / (g_window_width - 1.0f);
+    float shift_y = (g_view_matrix[13] - cache->translation[1]) * g_window_height / (g_window_height - 1.0f);
+    float left = 2 * (shift_x - cache->guard) / g_window_width - 1;
+    float top = 1 - 2 * (shift_y - cache->guard) / g_window_height;
+    glActiveTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_2D, cache->texture);
+    glActiveTexture(GL_TEXTURE0);
+    use_program(g_layer_cache_program);
+    glUniform4f(g_layer_cache_rect_location, left, top, left + 2.0f * cache->width / g_window_width, top - 2.0f * cache->height / g_window_height);
+    set_capability(GL_BLEND, 1);
+    set_capability(GL_DEPTH_TEST, 0);
+    glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+    const ShapeLod* quad = g_shapes[quad_shape()].lods;
+    bind_vertex_array(g_shape_vertex_array);
+    bind_instances(g_stream.buffer, g_instance_offset);
+    begin_gpu_pass(GPU_PASS_LAYER_CACHES);
+    glDrawElementsBaseVertex(GL_TRIANGLES, quad->index_count, GL_UNSIGNED_INT, (void*)(quad->first_index * sizeof(GLuint)), quad->first_vertex);
+    end_gpu_pass();
+    glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+    set_capability(GL_DEPTH_TEST, g_depth_layering);
+}
+
+// Makes the draws that follow go into a command list rather than to the screen, until
+// end_recording. Text and dynamic shapes can't be recorded, their glyphs and geometry may
+// move.
+static void begin_recording()
+{
+    assert(!g_recording_commands);
+    flush_draws();
+    g_recording_commands = 1;
+}
+
+// Sorts and merges the draws made since begin_recording once, and uploads their instances
+// and commands to a buffer that is kept for replaying them. Returns the command list, which
+// is handle if that is not NO_COMMAND_LIST, its previous draws are then replaced.
+static Handle end_recording(Handle handle)
+{
+    assert(g_recording_commands);
+    g_recording_commands = 0;
+
+    if (handle == NO_COMMAND_LIST)
+    {
+        g_command_lists = (CommandList*)grow_array(g_command_lists, &g_command_lists_capacity, g_num_command_lists + 1, sizeof(CommandList));
+        handle = g_num_command_lists++;
+        memset(g_command_lists + handle, 0, sizeof(CommandList));
+        glGenBuffers(1, &g_command_lists[handle].buffer);
+    }
+
+    assert(handle < g_num_command_lists);
+    CommandList* list = g_command_lists + handle;
+    sort_draws();
+    unsigned num_commands = build_commands();
+    free(list->draws);
+    free(list->commands);
+    list->num_draws = g_num_draws;
+    list->num_commands = num_commands;
+    list->draws = (Draw*)malloc(g_num_draws * sizeof(Draw));
+    list->commands = (DrawElementsIndirectCommand*)malloc(num_commands * sizeof(DrawElementsIndirectCommand));
+    memcpy(list->draws, g_draws, g_num_draws * sizeof(Draw));
+    memcpy(list->commands, g_commands, num_commands * sizeof(DrawElementsIndirectCommand));
+    memset(list->bounds, 0, sizeof(list->bounds));
+
+    for (unsigned i = 0; i < g_num_draws; ++i)
+    {
+        float bounds[4];
+        draw_world_bounds(g_draws + i, bounds);
+
+        if (i == 0)
+            memcpy(list->bounds, bounds, sizeof(bounds));
+
+        list->bounds[0] = bounds[0] < list->bounds[0] ? bounds[0] : list->bounds[0];
+        list->bounds[1] = bounds[1] < list->bounds[1] ? bounds[1] : list->bounds[1];
+        list->bounds[2] = bounds[2] > list->bounds[2] ? bounds[2] : list->bounds[2];
+        list->bounds[3] = bounds[3] > list->bounds[3] ? bounds[3] : list->bounds[3];
+    }
+
+    unsigned instances_size = g_num_draws * sizeof(Instance);
+    unsigned commands_size = num_commands * sizeof(DrawElementsIndirectCommand);
+    char* data = (char*)malloc(instances_size + commands_size);
+    Instance* instances = (Instance*)data;
+
+    for (unsigned i = 0; i < g_num_draws; ++i)
+        instances[i] = g_draws[i].instance;
+
+    memcpy(data + instances_size, g_commands, commands_size);
+    list->command_offset = instances_size;
+    bind_buffer(GL_COPY_WRITE_BUFFER, list->buffer);
+    glBufferData(GL_COPY_WRITE_BUFFER, instances_size + commands_size, data, GL_STATIC_DRAW);
+    free(data);
+    g_num_draws = 0;
+    return handle;
+}
+
+// Draws the command list moved by dx, dy, in order with the draws around it. The list is
+// drawn as it was batched, with the view projection translated rather than its instances,
+// and skipped entirely when its bounds are off screen.
+static void replay(Handle handle, float dx, float dy)
+{
+    assert(handle < g_num_command_lists && !g_recording_commands);
+    const CommandList* list = g_command_lists + handle;
+
+    if (list->num_commands == 0)
+        return;
+
+    flush_draws();
+    update_camera();
+    float translation[16];
+    float view_projection[16];
+    float clip_bounds[4];
+    mat_ident(translation);
+    translation[12] = dx;
+    translation[13] = dy;
+    mat_mul(translation, g_view_projection_matrix, view_projection);
+    transform_aabbs(view_projection, list->bounds, clip_bounds, 1);
+
+    if (clip_bounds[0] > 1 || clip_bounds[1] > 1 || clip_bounds[2] < -1 || clip_bounds[3] < -1)
+        return;
+
+    double start = clock_seconds();
+    submit_clear();
+
+    size_t camera_offset;
+    write_camera(stream_alloc(&g_stream, camera_size, &camera_offset), camera_offset, view_projection);
+    stream_commit(&g_stream);
+    g_instance_buffer = list->buffer;
+    g_instance_offset = 0;
+    g_command_offset = list->command_offset;
+
+    if (glMultiDrawElementsIndirect)
+        bind_buffer(GL_DRAW_INDIRECT_BUFFER, list->buffer);
+
+    begin_gpu_pass(GPU_PASS_DRAWS);
+    submit_commands(list->draws, list->commands, list->num_commands);
+    end_gpu_pass();
+    add_frame_timing(FRAME_TIMING_SUBMISSION, start);
+}
+
+static Font* get_font(unsigned size)
+{
+    GlyphCache* cache = &g_glyph_cache;
+    Font* font = 0;
+
+    for (unsigned i = 0; i < cache->num_fonts && !font; ++i)
+    {
+        if (cache->fonts[i].size == size)
+            font = cache->fonts + i;
+    }
+
+    if (!font)
+    {
+        if (!cache->device_context)
+            cache->device_context = CreateCompatibleDC(g_device_context);
+
+        // The font used the longest ago makes room, its glyphs stay cached.
+        if (cache->num_fonts == MAX_FONTS)
+        {
+            font = cache->fonts;
+
+            for (unsigned i = 1; i < MAX_FONTS; ++i)
+            {
+                if (cache->fonts[i].last_used < font->last_used)
+                    font = cache->fonts + i;
+            }
+
+            DeleteObject(font->handle);
+        }
+        else
+        {
+            font = cache->fonts + cache->num_fonts++;
+        }
+
+        TEXTMETRIC metrics;
+        font->size = size;
+        font->handle = CreateFontA(-(int)size, 0, 0, 0, FW_NORMAL, 0, 0, 0, DEFAULT_CHARSET, OUT_TT_PRECIS, CLIP_DEFAULT_PRECIS, ANTIALIASED_QUALITY, DEFAULT_PITCH, font_face);
+        SelectObject(cache->device_context, font->handle);
+        GetTextMetrics(cache->device_context, &metrics);
+        font->ascent = (float)metrics.tmAscent;
+        font->line_height = (float)(metrics.tmHeight + metrics.tmExternalLeading);
+    }
+
+    font->last_used = g_flush_count;
+    return font;
+}
+
+static int find_glyph(unsigned codepoint, unsigned size)
+{
+    const GlyphCache* cache = &g_glyph_cache;
+    unsigned slot = (codepoint * 31 + size) % (MAX_GLYPHS * 2);
+
+    while (cache->table[slot] != -1)
+    {
+        const Glyph* glyph = cache->glyphs + cache->table[slot];
+
+        if (glyph->codepoint == codepoint && glyph->size == size)
+            return cache->table[slot];
+
+        slot = (slot + 1) % (MAX_GLYPHS * 2);
+    }
+
+    return -1;
+}
+
+static void insert_glyph(unsigned index)
+{
+    GlyphCache* cache = &g_glyph_cache;
+    const Glyph* glyph = cache->glyphs + index;
+    unsigned slot = (glyph->codepoint * 31 + glyph->size) % (MAX_GLYPHS * 2);
+
+    while (cache->table[slot] != -1)
+        slot = (slot + 1) % (MAX_GLYPHS * 2);
+
+    cache->table[slot] = index;
+}
+
+// Empties the shelf used the longest ago among those holding glyphs at least height pixels
+// high, or all of them if there is none. Draws still waiting for the flush may show evicted glyphs, so
+// they are flushed first.
+static void evict_glyph_shelf(unsigned height)
+{
+    GlyphCache* cache = &g_glyph_cache;
+    int evicted = -1;
+
+    for (unsigned i = 0; i < cache->num_shelves; ++i)
+    {
+        if (cache->shelves[i].used > 0 && cache->shelves[i].height >= height && (evicted == -1 || cache->shelves[i].last_used < cache->shelves[evicted].last_used))
+            evicted = i;
+    }
+
+    flush_draws();
+    unsigned kept = 0;
+
+    for (unsigned i = 0; i < cache->num_glyphs; ++i)
+    {
+        if (evicted == -1 || cache->glyphs[i].shelf == (unsigned)evicted)
+            continue;
+
+        cache->glyphs[kept++] = cache->glyphs[i];
+    }
+
+    cache->num_glyphs = kept;
+    memset(cache->table, -1, sizeof(cache->table));
+
+    for (unsigned i = 0; i < cache->num_glyphs; ++i)
+        insert_glyph(i);
+
+    if (evicted == -1)
+    {
+        cache->num_shelves = 0;
+        cache->next_shelf_y = 0;
+        return;
+    }
+
+    cache->shelves[evicted].used = 0;
+}
+
+// Finds room for a width by height glyph on the shelf wasting the least height, or on a new
+// shelf. Glyphs are kept a pixel apart, as they are sampled with linear filtering.
+static int allocate_glyph(unsigned width, unsigned height, unsigned* shelf, unsigned* x)
+{
+    GlyphCache* cache = &g_glyph_cache;
+    int best = -1;
+    width += 1;
+    height += 1;
+
+    for (unsigned i = 0; i < cache->num_shelves; ++i)
+    {
+        const GlyphShelf* candidate = cache->shelves + i;
+
+        if (candidate->height < height || candidate->height > height + height / 4 + 2 || candidate->used + width > glyph_atlas_size)
+            continue;
+
+        if (best == -1 || candidate->height < cache->shelves[best].height)
+            best = i;
+    }
+
+    if (best == -1)
+    {
+        if (cache->num_shelves == MAX_GLYPH_SHELVES || cache->next_shelf_y + height > glyph_atlas_size)
+            return 0;
+
+        best = cache->num_shelves++;
+        cache->shelves[best].y = cache->next_shelf_y;
+        cache->shelves[best].height = height;
+        cache->shelves[best].used = 0;
+        cache->next_shelf_y += height;
+    }
+
+    *shelf = best;
+    *x = cache->shelves[best].used;
+    cache->shelves[best].used += width;
+    return 1;
+}
+
+// Returns the cached glyph, rasterizing it with GDI if it is not in the cache.
+static const Glyph* get_glyph(unsigned codepoint, unsigned size)
+{
+    GlyphCache* cache = &g_glyph_cache;
+
+    if (!cache->texture)
+    {
+        glGenTextures(1, &cache->texture);
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D, cache->texture);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, glyph_atlas_size, glyph_atlas_size, 0, GL_RED, GL_UNSIGNED_BYTE, 0);
+        glActiveTexture(GL_TEXTURE0);
+        memset(cache->table, -1, sizeof(cache->table));
+    }
+
+    int index = find_glyph(codepoint, size);
+
+    if (index != -1)
+    {
+        cache->shelves[cache->glyphs[index].shelf].last_used = g_flush_count;
+        return cache->glyphs + index;
+    }
+
+    Font* font = get_font(size);
+    static const MAT2 identity = { { 0, 1 }, { 0, 0 }, { 0, 0 }, { 0, 1 } };
+    GLYPHMETRICS metrics;
+    SelectObject(cache->device_context, font->handle);
+    DWORD bitmap_size = GetGlyphOutlineW(cache->device_context, codepoint, GGO_GRAY8_BITMAP, &metrics, 0, 0, &identity);
+
+    if (bitmap_size == GDI_ERROR)
+        return 0;
+
+    Glyph glyph;
+    glyph.codepoint = codepoint;
+    glyph.size = size;
+    glyph.width = bitmap_size ? metrics.gmBlackBoxX : 0;
+    glyph.height = bitmap_size ? metrics.gmBlackBoxY : 0;
+    glyph.left = metrics.gmptGlyphOrigin.x;
+    glyph.top = metrics.gmptGlyphOrigin.y;
+    glyph.advance = metrics.gmCellIncX;
+    glyph.shelf = 0;
+    glyph.x = 0;
+    glyph.y = 0;
+
+    if (glyph.width > 0)
+    {
+        assert(glyph.width < glyph_atlas_size && glyph.height < glyph_atlas_size);
+
+        while (cache->num_glyphs == MAX_GLYPHS || !allocate_glyph(glyph.width, glyph.height, &glyph.shelf, &glyph.x))
+            evict_glyph_shelf(glyph.height + 1);
+
+        glyph.y = cache->shelves[glyph.shelf].y;
+
+        // Rows of the gray bitmap are padded to four bytes and hold 65 levels of coverage.
+        unsigned pitch = (glyph.width + 3) & ~3u;
+        unsigned char* bitmap = (unsigned char*)malloc(bitmap_size);
+        GetGlyphOutlineW(cache->device_context, codepoint, GGO_GRAY8_BITMAP, &metrics, bitmap_size, bitmap, &identity);
+
+        for (unsigned row = 0; row < glyph.height; ++row)
+        {
+            for (unsigned column = 0; column < glyph.width; ++column)
+                bitmap[row * glyph.width + column] = (unsigned char)(bitmap[row * pitch + column] * 255 / 64);
+        }
+
+        glActiveTexture(GL_TEXTURE1);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, glyph.x, glyph.y, glyph.width, glyph.height, GL_RED, GL_UNSIGNED_BYTE, bitmap);
+        glActiveTexture(GL_TEXTURE0);
+        free(bitmap);
+    }
+    else if (cache->num_glyphs == MAX_GLYPHS)
+    {
+        evict_glyph_shelf(0);
+    }
+
+    index = cache->num_glyphs++;
+    cache->glyphs[index] = glyph;
+    insert_glyph(index);
+    cache->shelves[glyph.shelf].last_used = g_flush_count;
+    return cache->glyphs + index;
+}
+
+// Decodes the UTF-8 character at *text and moves past it. Bytes that do not start a valid
+// sequence are taken as they are.
+static unsigned next_codepoint(const char** text)
+{
+    const unsigned char* bytes = (const unsigned char*)*text;
+    unsigned length = bytes[0] >= 0xf0 ? 4 : (bytes[0] >= 0xe0 ? 3 : (bytes[0] >= 0xc0 ? 2 : 1));
+    unsigned codepoint = length == 1 ? bytes[0] : bytes[0] & (0x3f >> (length - 1));
+
+    for (unsigned i = 1; i < length; ++i)
+    {
+        if ((bytes[i] & 0xc0) != 0x80)
+        {
+            *text += 1;
+            return bytes[0];
+        }
+
+        codepoint = (codepoint << 6) | (bytes[i] & 0x3f);
+    }
+
+    *text += length;
+    return codepoint;
+}
+
+// Lays out the text with its top left corner at x, y, recording a draw for every glyph if
+// draw is set. Lines are broken at newlines. Writes the size of the text's box to size.
+static void layout_text(const char* text, float x, float y, unsigned size, int draw, float* text_size)
+{
+    assert(size > 0);
+    const Font* font = get_font(size);
+    float pen_x = x;
+    float baseline = y + font->ascent;
+    text_size[0] = 0;
+    text_size[1] = font->line_height;
+
+    while (*text)
+    {
+        unsigned codepoint = next_codepoint(&text);
+
+        if (codepoint == '\n')
+        {
+            pen_x = x;
+            baseline += font->line_height;
+            text_size[1] += font->line_height;
+            continue;
+        }
+
+        const Glyph* glyph = get_glyph(codepoint, size);
+
+        if (!glyph)
+            continue;
+
+        if (draw && glyph->width > 0)
+        {
+            float params[] = { (float)glyph->x, (float)glyph->y, (float)glyph->width, (float)glyph->height };
+            float center_x = pen_x + glyph->left + glyph->width * 0.5f;
+            float center_y = baseline - glyph->top + glyph->height * 0.5f;
+            record_draw(PROGRAM_TEXT, quad_shape(), 0, center_x, center_y, 0, 1, params, 1);
+        }
+
+        pen_x += glyph->advance;
+
+        if (pen_x - x > text_size[0])
+            text_size[0] = pen_x - x;
+    }
+}
+
+static void draw_text(const char* text, float x, float y, unsigned size)
+{
+    float text_size[2];
+    layout_text(text, x, y, size, 1, text_size);
+}
+
+//////
+// Expose lua API.
+
+static int is_window_open()
+{
+    return IsWindow(g_window_handle) && g_window_closed != 1;
+}
+
+static int pvx_init(lua_State* L)
 {
     const char* window_title = luaL_checkstring(L, 1);
     unsigned window_width = (unsigned)luaL_checknumber(L, 2);
@@ -464,50 +3903,533 @@ static int pvx_process_events(lua_State* L)
     return 0;
 }
 
+// pvx_wait_events(timeout). Sleeps until there is input or other window events, or timeout
+// seconds have passed, and then handles the events like pvx_process_events. Without a
+// timeout it waits for as long as it takes. Returns true if it was woken by events.
+static int pvx_wait_events(lua_State* L)
+{
+    DWORD timeout = INFINITE;
+
+    if (!lua_isnoneornil(L, 1))
+    {
+        double seconds = luaL_checknumber(L, 1);
+        luaL_argcheck(L, seconds >= 0, 1, "expected a timeout of zero seconds or more");
+        timeout = seconds * 1000 < INFINITE ? (DWORD)(seconds * 1000) : INFINITE - 1;
+    }
+
+    lua_settop(L, 0);
+    lua_pushboolean(L, wait_events(timeout));
+    return 1;
+}
+
+// pvx_time(). Returns seconds from the performance counter, which never goes backwards and
+// is precise to well below a microsecond. Only differences between calls are meaningful.
+static int pvx_time(lua_State* L)
+{
+    lua_settop(L, 0);
+    lua_pushnumber(L, clock_seconds());
+    return 1;
+}
+
+// pvx_run(update, render, hz). Runs the main loop until the window is closed or update
+// returns false. Events are handled each iteration, then update(dt) is called as many
+// times as needed to advance the simulation in fixed steps of dt = 1 / hz seconds, 60 by
+// default, and render(alpha) draws a frame that pvx_run presents. alpha is how far the
+// time left over is into the next step, for interpolating between the last two updates.
+static int pvx_run(lua_State* L)
+{
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    double hz = luaL_optnumber(L, 3, 60);
+    luaL_argcheck(L, hz > 0, 3, "expected a positive update rate");
+    lua_settop(L, 2);
+    double step = 1 / hz;
+    double lag = 0;
+    double previous = clock_seconds();
+    int running = 1;
+
+    while (running && is_window_open())
+    {
+        process_events();
+        double now = clock_seconds();
+
+        // After a long stall the simulation skips ahead rather than spending the next frames
+        // catching up.
+        lag += now - previous < max_run_lag ? now - previous : max_run_lag;
+        previous = now;
+
+        while (lag >= step && running)
+        {
+            lua_pushvalue(L, 1);
+            lua_pushnumber(L, step);
+            lua_call(L, 1, 1);
+            running = !(lua_isboolean(L, -1) && !lua_toboolean(L, -1));
+            lua_pop(L, 1);
+            lag -= step;
+        }
+
+        if (!running)
+            break;
+
+        lua_pushvalue(L, 2);
+        lua_pushnumber(L, lag / step);
+        lua_call(L, 1, 0);
+        flip();
+    }
+
+    lua_settop(L, 0);
+    return 0;
+}
+
 static int pvx_is_window_open(lua_State* L)
 {   
     lua_pushboolean(L, is_window_open());
     return 1;
 }
 
-static int pvx_add_shape(lua_State* L)
+static unsigned read_loop(lua_State* L, int index, const float* color, float* verts)
 {
-    static float verts[256];
-    float r = (float)luaL_checknumber(L, 1);
-    float g = (float)luaL_checknumber(L, 2);
-    float b = (float)luaL_checknumber(L, 3);
-    assert(lua_istable(L, 4));
-    int n = luaL_getn(L, 4);
-
-    int vertex_counter = 0;
+    int n = luaL_getn(L, index);
+    unsigned vertex_counter = 0;
 
     for (int i = 1; i <= n; ++i)
     {
-        lua_rawgeti(L, 4, i);
+        lua_rawgeti(L, index, i);
         verts[vertex_counter++] = (float)lua_tonumber(L, -1);
 
         if (i % 2 == 0)
         {
-            verts[vertex_counter++] = r;
-            verts[vertex_counter++] = g;
-            verts[vertex_counter++] = b;
+            memcpy(verts + vertex_counter, color, 3 * sizeof(float));
+            vertex_counter += 3;
         }
 
         lua_pop(L, 1);
     }
 
-    lua_pop(L, 4);
-    lua_pushnumber(L, add_shape(verts, n / 2));
+    return n / 2;
+}
+
+// Reads the outline at verts_index and the holes listed in the optional options table at
+// options_index. Outlines and holes of fewer than three vertices raise a Lua error. Free
+// the result with free_outline.
+static Outline read_outline(lua_State* L, int verts_index, int options_index, const float* color)
+{
+    Outline outline = {0};
+    luaL_checktype(L, verts_index, LUA_TTABLE);
+    outline.count = luaL_getn(L, verts_index) / 2;
+    luaL_argcheck(L, outline.count >= 3, verts_index, "expected an outline of at least three vertices");
+    int holes_index = 0;
+
+    if (lua_istable(L, options_index))
+    {
+        lua_getfield(L, options_index, "holes");
+
+        if (lua_istable(L, -1))
+        {
+            holes_index = lua_gettop(L);
+            outline.num_holes = luaL_getn(L, holes_index);
+
+            for (unsigned i = 1; i <= outline.num_holes; ++i)
+            {
+                lua_rawgeti(L, holes_index, i);
+                luaL_argcheck(L, lua_istable(L, -1) && luaL_getn(L, -1) / 2 >= 3, options_index, "expected holes of at least three vertices each");
+                outline.count += luaL_getn(L, -1) / 2;
+                lua_pop(L, 1);
+            }
+        }
+    }
+
+    outline.verts = (float*)malloc(outline.count * floats_per_vertex * sizeof(float));
+    outline.holes = (Hole*)malloc((outline.num_holes + 1) * sizeof(Hole));
+    unsigned vertex_counter = read_loop(L, verts_index, color, outline.verts);
+
+    for (unsigned i = 0; i < outline.num_holes; ++i)
+    {
+        lua_rawgeti(L, holes_index, i + 1);
+        outline.holes[i].first = vertex_counter;
+        outline.holes[i].count = read_loop(L, lua_gettop(L), color, outline.verts + vertex_counter * floats_per_vertex);
+        vertex_counter += outline.holes[i].count;
+        lua_pop(L, 1);
+    }
+
+    return outline;
+}
+
+static void free_outline(Outline* outline)
+{
+    free(outline->verts);
+    free(outline->holes);
+}
+
+// pvx_add_shape(r, g, b, verts, options). The optional options table may contain:
+// holes, a list of outlines in the same format as verts that are cut out of the shape.
+// fill, either "triangulate" (default) or "stencil". Stencil filled shapes need no
+// preprocessing, which suits huge or self intersecting outlines.
+// dynamic, if true the shape can be rewritten with pvx_update_shape.
+// capacity, the most vertices a dynamic shape will be updated with, holes included.
+static int pvx_add_shape(lua_State* L)
+{
+    float color[3];
+    color[0] = (float)luaL_checknumber(L, 1);
+    color[1] = (float)luaL_checknumber(L, 2);
+    color[2] = (float)luaL_checknumber(L, 3);
+    FillMode fill_mode = FILL_MODE_TRIANGULATE;
+    int dynamic = 0;
+    unsigned capacity = 0;
+
+    if (lua_istable(L, 5))
+    {
+        lua_getfield(L, 5, "fill");
+        const char* fill = lua_tostring(L, -1);
+
+        if (fill && strcmp(fill, "stencil") == 0)
+            fill_mode = FILL_MODE_STENCIL;
+
+        lua_getfield(L, 5, "dynamic");
+        dynamic = lua_toboolean(L, -1);
+        lua_getfield(L, 5, "capacity");
+        capacity = (unsigned)lua_tointeger(L, -1);
+        lua_pop(L, 3);
+    }
+
+    Outline outline = read_outline(L, 4, 5, color);
+    lua_settop(L, 0);
+    lua_pushnumber(L, add_shape(&outline, fill_mode, dynamic, capacity));
+    free_outline(&outline);
     return 1;
 }
 
+// pvx_update_shape(handle, verts, options). Replaces the outline of a dynamic shape, options
+// may contain holes just like for pvx_add_shape.
+static int pvx_update_shape(lua_State* L)
+{
+    unsigned handle = luaL_checkint(L, 1);
+    luaL_argcheck(L, handle < MAX_SHAPES && !g_free_shapes[handle], 1, "expected a shape");
+    luaL_argcheck(L, g_shapes[handle].dynamic, 1, "expected a dynamic shape");
+    luaL_checktype(L, 2, LUA_TTABLE);
+    const Shape* shape = g_shapes + handle;
+    Outline outline = read_outline(L, 2, 3, shape->color);
+    unsigned capacity = shape->vertex_capacity - (shape->fill_mode == FILL_MODE_STENCIL ? cover_vertex_count : 0);
+
+    // The geometry is written in place, so an outline that doesn't fit would overwrite
+    // other shapes. read_outline makes sure that every loop has at least three vertices,
+    // which the index range of dynamic shapes is sized for, but the indices are checked too.
+    if (outline.count > capacity || max_index_count(outline.count, outline.num_holes) > shape->index_capacity)
+    {
+        free_outline(&outline);
+        return luaL_argerror(L, 2, "expected no more vertices than the shape's capacity");
+    }
+
+    lua_settop(L, 0);
+    update_shape(handle, &outline);
+    free_outline(&outline);
+    return 0;
+}
+
+// pvx_draw_shape(handle, x, y, rotation, scale). Rotation is in radians and defaults to 0,
+// scale defaults to 1.
 static int pvx_draw_shape(lua_State* L)
 {
     unsigned handle = luaL_checkint(L, 1);
     float x = (float)luaL_checknumber(L, 2);
     float y = (float)luaL_checknumber(L, 3);
+    float rotation = (float)luaL_optnumber(L, 4, 0);
+    float scale = (float)luaL_optnumber(L, 5, 1);
+    luaL_argcheck(L, handle < MAX_SHAPES && !g_free_shapes[handle], 1, "expected a shape");
+    luaL_argcheck(L, !g_recording_commands || !g_shapes[handle].dynamic, 1, "dynamic shapes can't be recorded into a command list");
+    lua_settop(L, 0);
+    draw_shape(handle, x, y, rotation, scale);
+    return 0;
+}
+
+// pvx_draw_circle(x, y, radius). Drawn in the current tint, as are the other primitives.
+static int pvx_draw_circle(lua_State* L)
+{
+    float x = (float)luaL_checknumber(L, 1);
+    float y = (float)luaL_checknumber(L, 2);
+    float radius = (float)luaL_checknumber(L, 3);
+    lua_settop(L, 0);
+    draw_circle(x, y, radius);
+    return 0;
+}
+
+// pvx_draw_rounded_rect(x, y, width, height, radius, rotation). x, y is the center of the
+// rectangle, rotation is in radians and defaults to 0.
+static int pvx_draw_rounded_rect(lua_State* L)
+{
+    float x = (float)luaL_checknumber(L, 1);
+    float y = (float)luaL_checknumber(L, 2);
+    float width = (float)luaL_checknumber(L, 3);
+    float height = (float)luaL_checknumber(L, 4);
+    float radius = (float)luaL_checknumber(L, 5);
+    float rotation = (float)luaL_optnumber(L, 6, 0);
+    lua_settop(L, 0);
+    draw_rounded_rect(x, y, width * 0.5f, height * 0.5f, radius, rotation);
+    return 0;
+}
+
+// pvx_draw_capsule(x1, y1, x2, y2, radius). A line from x1, y1 to x2, y2 with round ends.
+static int pvx_draw_capsule(lua_State* L)
+{
+    float x1 = (float)luaL_checknumber(L, 1);
+    float y1 = (float)luaL_checknumber(L, 2);
+    float x2 = (float)luaL_checknumber(L, 3);
+    float y2 = (float)luaL_checknumber(L, 4);
+    float radius = (float)luaL_checknumber(L, 5);
+    lua_settop(L, 0);
+    draw_capsule(x1, y1, x2, y2, radius);
+    return 0;
+}
+
+// Reads the table of x, y pairs at index into g_line_points and returns how many points
+// it holds.
+static unsigned read_points(lua_State* L, int index)
+{
+    luaL_checktype(L, index, LUA_TTABLE);
+    int n = luaL_getn(L, index);
+    g_line_points = (float*)grow_array(g_line_points, &g_line_points_capacity, n, sizeof(float));
+
+    for (int i = 1; i <= n; ++i)
+    {
+        lua_rawgeti(L, index, i);
+        g_line_points[i - 1] = (float)lua_tonumber(L, -1);
+        lua_pop(L, 1);
+    }
+
+    return n / 2;
+}
+
+// Reads width, cap ("butt", "square" or "round") and join ("miter", "round" or "bevel")
+// from the optional options table at index.
+static Stroke read_stroke(lua_State* L, int index)
+{
+    Stroke stroke = { 0.5f, LINE_END_FLAT, LINE_END_FLAT };
+
+    if (!lua_istable(L, index))
+        return stroke;
+
+    lua_getfield(L, index, "width");
+    stroke.half_width = (float)luaL_optnumber(L, -1, 1) * 0.5f;
+    lua_getfield(L, index, "cap");
+    const char* cap = lua_tostring(L, -1);
+
+    if (cap && strcmp(cap, "square") == 0)
+        stroke.cap = LINE_END_SQUARE;
+    else if (cap && strcmp(cap, "round") == 0)
+        stroke.cap = LINE_END_ROUND;
+
+    lua_getfield(L, index, "join");
+    const char* join = lua_tostring(L, -1);
+
+    if (join && strcmp(join, "round") == 0)
+        stroke.join = LINE_END_ROUND_JOIN;
+    else if (join && strcmp(join, "bevel") == 0)
+        stroke.join = LINE_END_BEVEL;
+
     lua_pop(L, 3);
-    draw_shape(handle, x, y);
+    return stroke;
+}
+
+// pvx_draw_lines(points, options). points is a list of x, y pairs, every two points make
+// a segment. options may hold width (defaults to 1) and cap (defaults to "butt"). Lines
+// are drawn in the current tint.
+static int pvx_draw_lines(lua_State* L)
+{
+    unsigned count = read_points(L, 1);
+    Stroke stroke = read_stroke(L, 2);
+    lua_settop(L, 0);
+    draw_lines(g_line_points, count, &stroke);
+    return 0;
+}
+
+// pvx_draw_polyline(points, options). Draws the line through the list of x, y pairs in
+// points. Besides width and cap, options may hold join (defaults to "miter") and closed,
+// which joins the last point back to the first instead of capping the ends.
+static int pvx_draw_polyline(lua_State* L)
+{
+    unsigned count = read_points(L, 1);
+    Stroke stroke = read_stroke(L, 2);
+    int closed = 0;
+
+    if (lua_istable(L, 2))
+    {
+        lua_getfield(L, 2, "closed");
+        closed = lua_toboolean(L, -1);
+    }
+
+    lua_settop(L, 0);
+    draw_polyline(g_line_points, count, &stroke, closed);
+    return 0;
+}
+
+// pvx_add_image(width, height, pixels). pixels is a string of width * height RGBA pixels,
+// four bytes each, row by row from the top. Returns a handle for pvx_draw_sprite.
+static int pvx_add_image(lua_State* L)
+{
+    int width = luaL_checkint(L, 1);
+    int height = luaL_checkint(L, 2);
+    size_t size;
+    const char* pixels = luaL_checklstring(L, 3, &size);
+    luaL_argcheck(L, width > 0 && height > 0 && size == (size_t)width * height * 4, 3, "expected width * height RGBA pixels");
+    Handle handle = add_image(width, height, (const unsigned char*)pixels);
+    lua_settop(L, 0);
+    lua_pushnumber(L, handle);
+    return 1;
+}
+
+// pvx_draw_sprite(image, x, y, rotation, scale). Draws the image centered on x, y in the
+// current tint. Rotation is in radians and defaults to 0, scale defaults to 1.
+static int pvx_draw_sprite(lua_State* L)
+{
+    unsigned handle = luaL_checkint(L, 1);
+    float x = (float)luaL_checknumber(L, 2);
+    float y = (float)luaL_checknumber(L, 3);
+    float rotation = (float)luaL_optnumber(L, 4, 0);
+    float scale = (float)luaL_optnumber(L, 5, 1);
+    lua_settop(L, 0);
+    draw_sprite(handle, x, y, rotation, scale);
+    return 0;
+}
+
+// pvx_draw_text(text, x, y, size). Draws the UTF-8 text in the current tint, with its top
+// left corner at x, y and size pixels high glyphs, size defaulting to 16.
+static int pvx_draw_text(lua_State* L)
+{
+    const char* text = luaL_checkstring(L, 1);
+    float x = (float)luaL_checknumber(L, 2);
+    float y = (float)luaL_checknumber(L, 3);
+    int size = luaL_optint(L, 4, 16);
+    luaL_argcheck(L, size > 0, 4, "expected a positive size");
+
+    if (g_recording_commands)
+        return luaL_error(L, "text can't be recorded into a command list");
+
+    draw_text(text, x, y, size);
+    lua_settop(L, 0);
+    return 0;
+}
+
+// pvx_text_size(text, size). Returns the width and height that pvx_draw_text would use.
+static int pvx_text_size(lua_State* L)
+{
+    const char* text = luaL_checkstring(L, 1);
+    int size = luaL_optint(L, 2, 16);
+    luaL_argcheck(L, size > 0, 2, "expected a positive size");
+    float text_size[2];
+    layout_text(text, 0, 0, size, 0, text_size);
+    lua_settop(L, 0);
+    lua_pushnumber(L, text_size[0]);
+    lua_pushnumber(L, text_size[1]);
+    return 2;
+}
+
+// pvx_add_layer_cache(guard). Returns a layer cache, which renders the draws made between
+// pvx_begin_layer_cache and pvx_end_layer_cache into a texture that is then composited in
+// their place. guard is how many pixels past the window edges it renders, 256 by default,
+// the view can move that far before it has to be rendered again.
+static int pvx_add_layer_cache(lua_State* L)
+{
+    int guard = luaL_optint(L, 1, 256);
+    luaL_argcheck(L, guard >= 0, 1, "expected a guard band of zero pixels or more");
+    lua_settop(L, 0);
+    lua_pushnumber(L, add_layer_cache(guard));
+    return 1;
+}
+
+// pvx_begin_layer_cache(cache). Returns true if the draws of the cache have to be made
+// again, they can be skipped otherwise. Either way pvx_end_layer_cache has to follow.
+static int pvx_begin_layer_cache(lua_State* L)
+{
+    unsigned handle = luaL_checkint(L, 1);
+    lua_settop(L, 0);
+    lua_pushboolean(L, begin_layer_cache(handle));
+    return 1;
+}
+
+// pvx_end_layer_cache(cache). Composites the cache, in order with the draws around it.
+static int pvx_end_layer_cache(lua_State* L)
+{
+    unsigned handle = luaL_checkint(L, 1);
+    lua_settop(L, 0);
+    end_layer_cache(handle);
+    return 0;
+}
+
+// pvx_invalidate_layer_cache(cache). Makes the next pvx_begin_layer_cache return true, for
+// when what the cache shows has changed.
+static int pvx_invalidate_layer_cache(lua_State* L)
+{
+    unsigned handle = luaL_checkint(L, 1);
+    lua_settop(L, 0);
+    invalidate_layer_cache(handle);
+    return 0;
+}
+
+// pvx_record_begin(). Draws that follow are captured instead of drawn, until
+// pvx_record_end. Text and dynamic shapes can't be captured, drawing them raises an error.
+static int pvx_record_begin(lua_State* L)
+{
+    lua_settop(L, 0);
+    begin_recording();
+    return 0;
+}
+
+// pvx_record_end(list). Returns a command list of the captured draws, sorted and batched
+// once so that pvx_replay draws them in a few calls. If list is given its draws are
+// replaced instead of a new list being made.
+static int pvx_record_end(lua_State* L)
+{
+    unsigned handle = lua_isnoneornil(L, 1) ? NO_COMMAND_LIST : (unsigned)luaL_checkint(L, 1);
+    lua_settop(L, 0);
+    lua_pushnumber(L, end_recording(handle));
+    return 1;
+}
+
+// pvx_replay(list, dx, dy). Draws the command list moved by dx, dy, which default to 0.
+static int pvx_replay(lua_State* L)
+{
+    unsigned handle = luaL_checkint(L, 1);
+    float dx = (float)luaL_optnumber(L, 2, 0);
+    float dy = (float)luaL_optnumber(L, 3, 0);
+    lua_settop(L, 0);
+    replay(handle, dx, dy);
+    return 0;
+}
+
+// pvx_set_tint(r, g, b, a). Multiplies the color of all following draws, a defaults to 1.
+// Draws with an alpha below 1 are blended.
+static int pvx_set_tint(lua_State* L)
+{
+    float r = (float)luaL_checknumber(L, 1);
+    float g = (float)luaL_checknumber(L, 2);
+    float b = (float)luaL_checknumber(L, 3);
+    float a = (float)luaL_optnumber(L, 4, 1);
+    lua_settop(L, 0);
+    set_tint(r, g, b, a);
+    return 0;
+}
+
+// pvx_set_layer(layer). Draws made after this are drawn in order of layer, from -32768 to
+// 32767, and may be reordered within their layer to batch them. Blended draws always keep
+// their order. Calling it without a layer goes back to drawing in call order, those draws
+// are part of layer 0 and come after the ones that can be reordered.
+static int pvx_set_layer(lua_State* L)
+{
+    int layer = lua_isnoneornil(L, 1) ? NO_LAYER : luaL_checkint(L, 1);
+    luaL_argcheck(L, layer == NO_LAYER || (layer >= -32768 && layer <= 32767), 1, "expected a layer from -32768 to 32767");
+    lua_settop(L, 0);
+    set_layer(layer);
+    return 0;
+}
+
+// pvx_set_depth_layering(enabled). Lets the depth buffer keep layers apart, so that opaque
+// draws with a layer are batched regardless of their layer and the order they were made in.
+// Call it before clearing, draws of the current frame are drawn before it takes effect.
+static int pvx_set_depth_layering(lua_State* L)
+{
+    int enabled = lua_toboolean(L, 1);
+    lua_settop(L, 0);
+    set_depth_layering(enabled);
     return 0;
 }
 
@@ -521,9 +4443,118 @@ static int pvx_clear(lua_State* L)
     return 0;
 }
 
+// pvx_flip(). Presents the frame. Returns false if it was skipped for being unchanged, see
+// pvx_set_skip_unchanged_frames.
 static int pvx_flip(lua_State* L)
 {
-    flip();
+    lua_pushboolean(L, flip());
+    return 1;
+}
+
+// pvx_set_present_mode(mode). mode is "vsync", "adaptive" (the default) or "immediate".
+// Adaptive waits for vertical sync unless the frame is late, immediate never waits.
+static int pvx_set_present_mode(lua_State* L)
+{
+    static const char* modes[] = { "vsync", "adaptive", "immediate", NULL };
+    int mode = luaL_checkoption(L, 1, NULL, modes);
+    lua_settop(L, 0);
+    set_present_mode((PresentMode)mode);
+    return 0;
+}
+
+// pvx_set_frame_limit(fps). Makes pvx_flip keep frames 1 / fps seconds apart, sleeping
+// and then spinning for precision. 0 or nil removes the limit.
+static int pvx_set_frame_limit(lua_State* L)
+{
+    double fps = luaL_optnumber(L, 1, 0);
+    luaL_argcheck(L, fps >= 0, 1, "expected a frame rate of zero or more");
+    lua_settop(L, 0);
+    set_frame_limit(fps > 0 ? 1 / fps : 0);
+    return 0;
+}
+
+// pvx_frame_pacing(). Returns the average and the worst number of seconds by which the
+// recent frames missed the frame limit.
+static int pvx_frame_pacing(lua_State* L)
+{
+    float average, worst;
+    frame_pacing(&average, &worst);
+    lua_settop(L, 0);
+    lua_pushnumber(L, average);
+    lua_pushnumber(L, worst);
+    return 2;
+}
+
+// pvx_frame_stats(). Returns a table with the fields events, recording, submission,
+// present, idle and frame, and frames, the number of recent frames they cover. Each of the
+// first six is a table of average, p50, p95 and p99, in seconds spent per frame on handling
+// events, on the Lua code making draws, on submitting them, on presenting and waiting for
+// the frame limit, on blocking until input arrives, and on the whole frame.
+static int pvx_frame_stats(lua_State* L)
+{
+    static const char* timing_names[NUM_FRAME_TIMINGS] = { "events", "recording", "submission", "present", "idle", "frame" };
+    static const char* stat_names[] = { "average", "p50", "p95", "p99" };
+    unsigned count = 0;
+    lua_settop(L, 0);
+    lua_newtable(L);
+
+    for (unsigned i = 0; i < NUM_FRAME_TIMINGS; ++i)
+    {
+        float stats[4];
+        count = frame_stats((FrameTiming)i, stats);
+        lua_newtable(L);
+
+        for (unsigned j = 0; j < 4; ++j)
+        {
+            lua_pushnumber(L, stats[j]);
+            lua_setfield(L, -2, stat_names[j]);
+        }
+
+        lua_setfield(L, -2, timing_names[i]);
+    }
+
+    lua_pushnumber(L, count);
+    lua_setfield(L, -2, "frames");
+    return 1;
+}
+
+// pvx_gpu_times(). Returns a table of how many seconds the GPU spent on the clear, draws
+// and layer_caches passes of a recent frame, and frame, the time from the start of its
+// first pass to the end of its last. Time in frame that the passes don't account for is the
+// GPU waiting for work. The frame is a few frames old, since the times are only read once
+// they are ready. Returns nil until the first times are ready or without timer queries.
+static int pvx_gpu_times(lua_State* L)
+{
+    static const char* names[NUM_GPU_PASSES + 1] = { "clear", "draws", "layer_caches", "frame" };
+    lua_settop(L, 0);
+
+    if (!g_gpu_times_known)
+    {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    lua_newtable(L);
+
+    for (unsigned i = 0; i < NUM_GPU_PASSES + 1; ++i)
+    {
+        lua_pushnumber(L, g_gpu_times[i]);
+        lua_setfield(L, -2, names[i]);
+    }
+
+    return 1;
+}
+
+// pvx_set_skip_unchanged_frames(enabled). Makes pvx_flip compare each frame's draws, clear
+// color and view to the last frame presented, and skip drawing and presenting it if they
+// are the same. Meant for menus and other screens that mostly stand still, which then idle
+// until input arrives or a refresh interval has passed. Only frames that clear and draw
+// everything they show can be skipped.
+static int pvx_set_skip_unchanged_frames(lua_State* L)
+{
+    int enabled = lua_toboolean(L, 1);
+    lua_settop(L, 0);
+    set_skip_unchanged_frames(enabled);
     return 0;
 }
 
@@ -546,8 +4577,67 @@ static int pvx_move_view(lua_State* L)
 
 static int pvx_view_pos(lua_State* L)
 {
-    lua_pushnumber(L, -g_view_matrix[12]);
-    lua_pushnumber(L, -g_view_matrix[13]);
+    lua_pushnumber(L, g_view_position[0]);
+    lua_pushnumber(L, g_view_position[1]);
+    return 2;
+}
+
+static int pvx_set_view_zoom(lua_State* L)
+{
+    float zoom = (float)luaL_checknumber(L, 1);
+    lua_pop(L, 1);
+    set_view_zoom(zoom);
+    return 0;
+}
+
+static int pvx_view_zoom(lua_State* L)
+{
+    lua_pushnumber(L, g_view_zoom);
+    return 1;
+}
+
+static int pvx_set_view_rotation(lua_State* L)
+{
+    float rotation = (float)luaL_checknumber(L, 1);
+    lua_pop(L, 1);
+    set_view_rotation(rotation);
+    return 0;
+}
+
+static int pvx_view_rotation(lua_State* L)
+{
+    lua_pushnumber(L, g_view_rotation);
+    return 1;
+}
+
+// pvx_screen_to_world(x, y). Returns where the window pixel x, y is in the world, with the
+// current view. Also takes a list of x, y pairs instead, and then returns a list of the
+// world positions of them all.
+static int pvx_screen_to_world(lua_State* L)
+{
+    if (lua_istable(L, 1))
+    {
+        unsigned count = read_points(L, 1);
+        screen_to_world(g_line_points, count);
+        lua_settop(L, 0);
+        lua_createtable(L, count * 2, 0);
+
+        for (unsigned i = 0; i < count * 2; ++i)
+        {
+            lua_pushnumber(L, g_line_points[i]);
+            lua_rawseti(L, -2, i + 1);
+        }
+
+        return 1;
+    }
+
+    float point[2];
+    point[0] = (float)luaL_checknumber(L, 1);
+    point[1] = (float)luaL_checknumber(L, 2);
+    lua_settop(L, 0);
+    screen_to_world(point, 1);
+    lua_pushnumber(L, point[0]);
+    lua_pushnumber(L, point[1]);
     return 2;
 }
 
@@ -583,15 +4673,49 @@ int __declspec(dllexport) pvx_load(lua_State* L)
     lua_register(L, "pvx_init", pvx_init);
     lua_register(L, "pvx_deinit", pvx_deinit);
     lua_register(L, "pvx_process_events", pvx_process_events);
+    lua_register(L, "pvx_wait_events", pvx_wait_events);
     lua_register(L, "pvx_is_window_open", pvx_is_window_open);
+    lua_register(L, "pvx_time", pvx_time);
+    lua_register(L, "pvx_run", pvx_run);
     lua_register(L, "pvx_add_shape", pvx_add_shape);
+    lua_register(L, "pvx_update_shape", pvx_update_shape);
     lua_register(L, "pvx_draw_shape", pvx_draw_shape);
+    lua_register(L, "pvx_draw_circle", pvx_draw_circle);
+    lua_register(L, "pvx_draw_rounded_rect", pvx_draw_rounded_rect);
+    lua_register(L, "pvx_draw_capsule", pvx_draw_capsule);
+    lua_register(L, "pvx_draw_lines", pvx_draw_lines);
+    lua_register(L, "pvx_draw_polyline", pvx_draw_polyline);
+    lua_register(L, "pvx_add_image", pvx_add_image);
+    lua_register(L, "pvx_draw_sprite", pvx_draw_sprite);
+    lua_register(L, "pvx_draw_text", pvx_draw_text);
+    lua_register(L, "pvx_text_size", pvx_text_size);
+    lua_register(L, "pvx_add_layer_cache", pvx_add_layer_cache);
+    lua_register(L, "pvx_begin_layer_cache", pvx_begin_layer_cache);
+    lua_register(L, "pvx_end_layer_cache", pvx_end_layer_cache);
+    lua_register(L, "pvx_invalidate_layer_cache", pvx_invalidate_layer_cache);
+    lua_register(L, "pvx_record_begin", pvx_record_begin);
+    lua_register(L, "pvx_record_end", pvx_record_end);
+    lua_register(L, "pvx_replay", pvx_replay);
+    lua_register(L, "pvx_set_tint", pvx_set_tint);
+    lua_register(L, "pvx_set_layer", pvx_set_layer);
+    lua_register(L, "pvx_set_depth_layering", pvx_set_depth_layering);
     lua_register(L, "pvx_clear", pvx_clear);
     lua_register(L, "pvx_flip", pvx_flip);
+    lua_register(L, "pvx_set_skip_unchanged_frames", pvx_set_skip_unchanged_frames);
+    lua_register(L, "pvx_set_present_mode", pvx_set_present_mode);
+    lua_register(L, "pvx_set_frame_limit", pvx_set_frame_limit);
+    lua_register(L, "pvx_frame_pacing", pvx_frame_pacing);
+    lua_register(L, "pvx_frame_stats", pvx_frame_stats);
+    lua_register(L, "pvx_gpu_times", pvx_gpu_times);
     lua_register(L, "pvx_key_held", pvx_key_held);
     lua_register(L, "pvx_move_view", pvx_move_view);
     lua_register(L, "pvx_view_pos", pvx_view_pos);
+    lua_register(L, "pvx_set_view_zoom", pvx_set_view_zoom);
+    lua_register(L, "pvx_view_zoom", pvx_view_zoom);
+    lua_register(L, "pvx_set_view_rotation", pvx_set_view_rotation);
+    lua_register(L, "pvx_view_rotation", pvx_view_rotation);
     lua_register(L, "pvx_mouse_pos", pvx_mouse_pos);
+    lua_register(L, "pvx_screen_to_world", pvx_screen_to_world);
     lua_register(L, "pvx_window_size", pvx_window_size);
     lua_register(L, "pvx_left_mouse_held", pvx_left_mouse_held);
     lua_register(L, "pvx_right_mouse_held", pvx_right_mouse_held);